@@ -8,6 +8,8 @@
 #include <sstream>
 #include <fstream>
 #include <future>
+#include <chrono>
+#include <cstring>
 #include "glm/geometric.hpp"
 #include "glm/gtx/transform.hpp"
 #include "glm/gtx/rotate_vector.hpp"
@@ -16,11 +18,8 @@
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include "renderer.h"
-
-static Triangle make_triangle(Vec3 v0, Vec3 v1, Vec3 v2, Material *material) {
-	Triangle t{ { v0, v1, v2 }, glm::normalize(glm::cross(v1 - v0, v2 - v0)), material };
-	return t;
-}
+#include "objloader.h"
+#include "meshcache.h"
 
 static Triangle make_triangle(Vec3 v0, glm::vec2 t0, Vec3 v1, glm::vec2 t1, Vec3 v2, glm::vec2 t2, Material *material) {
 	Triangle t{ { v0, v1, v2 }, glm::normalize(glm::cross(v1 - v0, v2 - v0)), material };
@@ -30,38 +29,35 @@ static Triangle make_triangle(Vec3 v0, glm::vec2 t0, Vec3 v1, glm::vec2 t1, Vec3
 	return t;
 }
 
-static void readModel(Scene &scene, std::string path, float scaleFactor, glm::mat4x4 &rotation, Material *material, std::vector<Triangle> &triangles) {
-	std::ifstream f(path);
-	std::string line;
-	std::vector<Vec3> vs;
-
-	while (std::getline(f, line)) {
-		std::stringstream ss(line);
-		std::string type;
-		ss >> type;
-		if (type == "v") {
-			Vec3 v;
-			ss >> v.x >> v.y >> v.z;
-			vs.push_back(Vec3(rotation * glm::vec4({ v.x, v.y, v.z, 1.0f }) * scaleFactor));
-		}
-		else if (type == "f") {
-			std::string v_str;
-			std::vector<int> f;
-			while (ss >> v_str) {
-				int v = atoi(v_str.c_str());
-				if (v < 0)
-					v += vs.size();
-				else
-					v--;
-				f.push_back(v);
-			}
-			for (int i = 0; i < f.size() - 2; i++) {
-				triangles.push_back(make_triangle(vs[f[i]], vs[f[i + 1]], vs[f[i + 2]], material));
-			}
-		}
+// Loads a model and builds its BVH, or takes both from the cache saved by an earlier run with the same inputs
+static void readModel(Scene &scene, std::string path, float scaleFactor, const glm::mat4x4 &rotation, Material *material, Mesh &mesh, int threads) {
+	auto start = std::chrono::steady_clock::now();
+	mesh.material = material;
+	CacheKey key;
+	bool cacheable = hashFile(path.c_str(), key);
+	key = hashBytes(&scaleFactor, sizeof(scaleFactor), key);
+	key = hashBytes(&rotation, sizeof(rotation), key);
+	std::string cachePath = meshCachePath(path, key);
+	if (cacheable && loadMeshCache(cachePath.c_str(), key, mesh)) {
+		std::cout << "vertex: " << mesh.vertices.size() << ", triangles: " << mesh.triangleCount() <<
+			" from cache in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s" << std::endl;
+		return;
 	}
 
-	std::cout << "vertex: " << vs.size() << std::endl;
+	if (!loadOBJ(path.c_str(), mesh, threads)) {
+		std::cout << "can't load " << path << std::endl;
+		return;
+	}
+	for (Vec3 &v : mesh.vertices)
+		v = Vec3(rotation * glm::vec4({ v.x, v.y, v.z, 1.0f }) * scaleFactor);
+	std::cout << "vertex: " << mesh.vertices.size() << ", triangles: " << mesh.triangleCount() <<
+		" in " << std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << "s" << std::endl;
+
+	BuildStats stats;
+	buildMesh(mesh, threads, &stats);
+	std::cout << "built model BVH: " << stats.nodes << " nodes in " << stats.buildTime << "s" << std::endl;
+	if (cacheable && !saveMeshCache(cachePath.c_str(), key, mesh))
+		std::cout << "can't write " << cachePath << std::endl;
 }
 
 Material copper = { { 0.329412, 0.223529, 0.027451 },
@@ -143,53 +139,58 @@ static Color checkerTexture(glm::vec2 texCoord) {
 		return Color(1, 1, 1);
 }
 
-std::vector<Triangle> model;
+Mesh model, cube;
+Mat4 modelTransform;
+
+static void addPlane(std::vector<Triangle> &triangles, Vec3 lefttop, glm::vec2 uv0, Vec3 leftbottom, glm::vec2 uv1, Vec3 rightbottom, glm::vec2 uv2, Vec3 righttop, glm::vec2 uv3, Material *mat) {
+	triangles.push_back(make_triangle(lefttop, uv0, leftbottom, uv1, righttop, uv3, mat));
+	triangles.push_back(make_triangle(righttop, uv3, leftbottom, uv1, rightbottom, uv2, mat));
+}
 
-static void addPlane(Scene &scene, Vec3 lefttop, glm::vec2 uv0, Vec3 leftbottom, glm::vec2 uv1, Vec3 rightbottom, glm::vec2 uv2, Vec3 righttop, glm::vec2 uv3, Material *mat) {
-	scene.triangles.push_back(make_triangle(lefttop, uv0, leftbottom, uv1, righttop, uv3, mat));
-	scene.triangles.push_back(make_triangle(righttop, uv3, leftbottom, uv1, rightbottom, uv2, mat));
+// Same triangles as above, with four vertices of their own since corners of different faces don't share texture coordinates
+static void addPlane(Mesh &mesh, Vec3 lefttop, glm::vec2 uv0, Vec3 leftbottom, glm::vec2 uv1, Vec3 rightbottom, glm::vec2 uv2, Vec3 righttop, glm::vec2 uv3) {
+	unsigned int base = mesh.vertices.size();
+	mesh.vertices.insert(mesh.vertices.end(), { lefttop, leftbottom, rightbottom, righttop });
+	mesh.texCoords.insert(mesh.texCoords.end(), { uv0, uv1, uv2, uv3 });
+	mesh.indices.insert(mesh.indices.end(), { base, base + 1, base + 3, base + 3, base + 1, base + 2 });
 }
 
-static void addCube(Scene &scene, Vec3 center, Vec3 size, Material *mat) {
+static void addCube(Mesh &mesh, Vec3 center, Vec3 size, Material *mat) {
+	mesh.material = mat;
 	Vec3 half = size / 2.0f;
 	// front
-	addPlane(scene,
+	addPlane(mesh,
 		{ center.x - half.x, center.y + half.y, center.z + half.z }, { 0, 0 },
 		{ center.x - half.x, center.y - half.y, center.z + half.z }, { 0, 1 },
 		{ center.x + half.x, center.y - half.y, center.z + half.z }, { 1, 1 },
-		{ center.x + half.x, center.y + half.y, center.z + half.z }, { 1, 0 },
-		mat);
+		{ center.x + half.x, center.y + half.y, center.z + half.z }, { 1, 0 });
 	// back
-	addPlane(scene,
+	addPlane(mesh,
 		{ center.x + half.x, center.y + half.y, center.z - half.z }, { 0, 0 },
 		{ center.x + half.x, center.y - half.y, center.z - half.z }, { 0, 1 },
 		{ center.x - half.x, center.y - half.y, center.z - half.z }, { 1, 1 },
-		{ center.x - half.x, center.y + half.y, center.z - half.z }, { 1, 0 },
-		mat);
+		{ center.x - half.x, center.y + half.y, center.z - half.z }, { 1, 0 });
 	// top
-	addPlane(scene,
+	addPlane(mesh,
 		{ center.x - half.x, center.y + half.y, center.z - half.z }, { 0, 0 },
 		{ center.x - half.x, center.y + half.y, center.z + half.z }, { 0, 1 },
 		{ center.x + half.x, center.y + half.y, center.z + half.z }, { 1, 1 },
-		{ center.x + half.x, center.y + half.y, center.z - half.z }, { 1, 0 },
-		mat);
+		{ center.x + half.x, center.y + half.y, center.z - half.z }, { 1, 0 });
 	// left
-	addPlane(scene,
+	addPlane(mesh,
 		{ center.x - half.x, center.y + half.y, center.z - half.z }, { 0, 0 },
 		{ center.x - half.x, center.y - half.y, center.z - half.z }, { 0, 1 },
 		{ center.x - half.x, center.y - half.y, center.z + half.z }, { 1, 1 },
-		{ center.x - half.x, center.y + half.y, center.z + half.z }, { 1, 0 },
-		mat);
+		{ center.x - half.x, center.y + half.y, center.z + half.z }, { 1, 0 });
 	// right
-	addPlane(scene,
+	addPlane(mesh,
 		{ center.x + half.x, center.y + half.y, center.z + half.z }, { 0, 0 },
 		{ center.x + half.x, center.y - half.y, center.z + half.z }, { 0, 1 },
 		{ center.x + half.x, center.y - half.y, center.z - half.z }, { 1, 1 },
-		{ center.x + half.x, center.y + half.y, center.z - half.z }, { 1, 0 },
-		mat);
+		{ center.x + half.x, center.y + half.y, center.z - half.z }, { 1, 0 });
 }
 
-static void setupScene(Scene &scene) {
+static void setupScene(Scene &scene, int threads) {
 	checker.texFunc = checkerTexture;
 	wall1.texFunc = [](glm::vec2 texCoord) { return Color(1, texCoord.y*texCoord.y, 0); };
 	wall2.texFunc = [](glm::vec2 texCoord) { return Color(0, texCoord.y*texCoord.y, 1); };
@@ -202,13 +203,17 @@ static void setupScene(Scene &scene) {
 	//scene.spheres.push_back({ { 0.0, 2, 0 }, 0.4, &chrome });
 	//    scene.spheres.push_back({{-0.2, 0.1, 0.0}, 0.05, &chrome});
 	/*
-	addPlane(scene, { -w, h, front }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { -w, y, back }, { 1, 1 }, { -w, h, back }, { 1, 0 }, &wall1); // left
-	addPlane(scene, { w, h, back }, { 0, 0 }, { w, y, back }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, h, front }, { 1, 0 }, &wall3); // right
+	addPlane(scene.triangles, { -w, h, front }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { -w, y, back }, { 1, 1 }, { -w, h, back }, { 1, 0 }, &wall1); // left
+	addPlane(scene.triangles, { w, h, back }, { 0, 0 }, { w, y, back }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, h, front }, { 1, 0 }, &wall3); // right
     */
 	std::cout << "OK" << std::endl;
-	readModel(scene, "2009210107_3.obj", 1.0, glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &copper, model);
-	//readModel(scene, "2009210107_3.obj", 1.0, glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &glass, model);
-	//readModel(scene, "2009210107_3.obj", 1.0, glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &chrome, model);
+	// Meshes never change, so their BVHs are built once and only the top level is rebuilt per frame
+	readModel(scene, "2009210107_3.obj", 1.0, Mat4(), &copper, model, threads);
+	//readModel(scene, "2009210107_3.obj", 1.0, glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &glass, model, threads);
+	//readModel(scene, "2009210107_3.obj", 1.0, glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &chrome, model, threads);
+	modelTransform = glm::translate(Vec3({ -1.0, 0.0, 1.5 })) * glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 }));
+	addCube(cube, { 0, 0, 0 }, { 1, 1, 1 }, nullptr);
+	buildMesh(cube, threads);
 
 	scene.camera.zNear = 0.01;
 	scene.camera.zFar = 10.0;
@@ -232,7 +237,16 @@ int main(int argc, char **argv) {
 		return guiMain();
 	}
 
-	setupScene(scene);
+	params.threads = 8;
+	params.samples = 1;
+	params.packetSize = 8;
+	params.minRayWeight = 1.0f / 256;
+	params.wavefront = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--wavefront") == 0)
+			params.wavefront = true;
+	}
+	setupScene(scene, params.threads);
 
     // ffmpeg -framerate 30 -i frame%04d.png -i ../scripts/sound.wav -c:v libx264 -c:a aac -strict experimental -b:a 192k -shortest -r 30 -pix_fmt yuv420p out.mp4
     int x, y, n;
@@ -268,12 +282,9 @@ int main(int argc, char **argv) {
     scene.camera.up = { 0, 1, 0 };
     params.width = w;
     params.height = h;
-    params.enableOctree = true;
+    params.accel = ACCEL_BVH;
     params.depthLimit = 2;
-    params.threads = 8;
-    destroyOctree(scene);
-    if (params.enableOctree)
-        buildOctree(scene);
+    buildAccel(scene, params);
     unsigned char *bytedata = new unsigned char[params.width * params.height * 3]; // RGB
     char filename[20];
 
@@ -292,8 +303,11 @@ int main(int argc, char **argv) {
 	seconds += startseconds;
     for (int i = startseconds * fps; i < fps * seconds; i++) {
 		std::cout << "rendering frame #" << i << std::endl;
+		// The scene is only modified here, between frames; render() shares it with its workers in place
 		scene.spheres.clear();
 		scene.triangles.clear();
+		scene.instances.clear();
+		scene.instances.push_back(makeInstance(model, modelTransform));
         float sumlow = 0, sumhigh = 0;
 		for (int j = 0; j < nbands; j++) {
 			float s = rfreqdata[i * nbands + j];
@@ -304,8 +318,8 @@ int main(int argc, char **argv) {
 		}
 		{
 			float w = 5.0, front = 5.0, back = -5.0, h = 5.0, y = -0.01f;
-			addPlane(scene, { -w, y, back }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, y, back }, { 1, 0 }, &checker); // floor
-			//w = 10.0; y = -5.0; addPlane(scene, { -w, h, back }, { 0, 0 }, { -w, y, back }, { 0, 1 }, { w, y, back }, { 1, 1 }, { w, h, back }, { 1, 0 }, &chrome); // center
+			addPlane(scene.triangles, { -w, y, back }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, y, back }, { 1, 0 }, &checker); // floor
+			//w = 10.0; y = -5.0; addPlane(scene.triangles, { -w, h, back }, { 0, 0 }, { -w, y, back }, { 0, 1 }, { w, y, back }, { 1, 1 }, { w, h, back }, { 1, 0 }, &chrome); // center
 		}
 		float ww = 2.5f;
 		float dw = ww * 2 / nbands;
@@ -314,21 +328,29 @@ int main(int argc, char **argv) {
 			float s = 2.0f * rfreqdata[i * nbands + j];
 			float x0 = (dw + 0.025f) * (j - nbands/2) - (dw + 0.025f) / 2;
 			float x1 = x0 + dw;
-			addCube(scene, { (x0 + x1) / 2.0f, s / 2.0f, back }, { dw, s, dw }, &barMaterials[j]);
+			// A zero scale would make the transform singular
+			float height = std::max(s, 1e-4f);
+			scene.instances.push_back(makeInstance(cube, glm::translate(Vec3({ (x0 + x1) / 2.0f, height / 2.0f, back })) * glm::scale(Vec3({ dw, height, dw })), &barMaterials[j]));
 			//scene.spheres.push_back({ { x0 * 2.5f, (s / 2.0f) * (s / 2.0f), 0 }, s / 4.0f, &barMaterials[j] });
-			//addCube(scene, { (x0 + x1) / 2.0f, s / 2.0f, back }, { dw, s, dw }, &chrome);
+			//addCube(scene.triangles, { (x0 + x1) / 2.0f, s / 2.0f, back }, { dw, s, dw }, &chrome);
         }
-		for (const Triangle &t : model)
-			scene.triangles.push_back(t);
 		//scene.spheres.push_back({ { 0.0, 0.4, 1 }, 0.4, &chrome });
 
-		destroyOctree(scene);
-		buildOctree(scene);
+		BuildStats buildStats;
+		buildAccel(scene, params, &buildStats);
+		std::cout << "  build: " << buildStats.nodes << " nodes, " << buildStats.references << " references in " << buildStats.buildTime << "s" << std::endl;
 		float intensity = sumhigh / (nbands / 2);
 		scene.lights[0].intensity = 1.0f + 2.0f * intensity * intensity;
 		//scene.lights[1].spotDir = glm::normalize(Vec3({ -ww * intensity, 0.75f, front }) - scene.lights[1].position);
 		//scene.lights[2].spotDir = glm::normalize(Vec3({ ww * (sumlow / (nbands / 2)), 0.75f, front }) - scene.lights[2].position);
-        render(scene, pixels, params);
+        RenderStats stats;
+        render(scene, pixels, params, &stats);
+        std::cout << "  tiles: " << stats.tiles << " (" << stats.stolenTiles << " stolen), load balance: " << stats.loadBalance << std::endl;
+        if (params.accel == ACCEL_OCTREE)
+            std::cout << "  object tests: " << stats.objectTests << " (" << stats.skippedObjectTests << " skipped by mailbox)" << std::endl;
+        std::cout << "  secondary rays: " << stats.secondaryRays << " (" << stats.prunedRays << " pruned)" << std::endl;
+        std::cout << "  shadow rays: " << stats.shadowRays << " (" << stats.sharedShadowRays << " shared)" << std::endl;
+        std::cout << "  occluder cache: " << stats.occluderHits << " hits of " << stats.occluderTests << " tests" << std::endl;
         int p = 0;
         for (int y = h - 1; y >= 0; y--) {
             for (int x = 0; x < w; x++) {
@@ -371,6 +393,8 @@ int main(int argc, char **argv) {
 #define ID_RESW                                 40013
 #define ID_OCTREE                               40014
 #define ID_PREVIEW                              40015
+#define ID_BVH                                  40016
+#define ID_NOACCEL                              40017
 
 HWND ctrlWnd, renderWnd;
 BITMAPINFO bitmapInfo;
@@ -407,12 +431,19 @@ static void setupRenderParams() {
 	scene.camera.up = { GetDlgItemFloat(ID_CAMUPX), GetDlgItemFloat(ID_CAMUPY), GetDlgItemFloat(ID_CAMUPZ) };
 	params.width = w;
 	params.height = h;
-	params.enableOctree = IsDlgButtonChecked(ctrlWnd, ID_OCTREE);
+	if (IsDlgButtonChecked(ctrlWnd, ID_BVH))
+		params.accel = ACCEL_BVH;
+	else if (IsDlgButtonChecked(ctrlWnd, ID_OCTREE))
+		params.accel = ACCEL_OCTREE;
+	else
+		params.accel = ACCEL_NONE;
 	params.depthLimit = GetDlgItemInt(ctrlWnd, ID_NRAYBOUNCE, NULL, FALSE);
 	params.threads = 4;
-	destroyOctree(scene);
-	if (params.enableOctree)
-		buildOctree(scene);
+	params.samples = 1;
+	params.packetSize = 8;
+	params.minRayWeight = 1.0f / 256;
+	params.wavefront = false;
+	buildAccel(scene, params);
 }
 
 static void setupGUIScene(Scene &scene) {
@@ -427,11 +458,12 @@ static void setupGUIScene(Scene &scene) {
 	scene.spheres.push_back({ { -0.4, 0.2, 0.0 }, 0.2, &glass });
 
 	float w = 5.0, front = 2.0, back = -2.0, h = 5.0, y = -0.01f;
-	addPlane(scene, { -w, y, back }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, y, back }, { 1, 0 }, &wall2); // floor
-	addPlane(scene, { -w, h, back }, { 0, 0 }, { -w, y, back }, { 0, 1 }, { w, y, back }, { 1, 1 }, { w, h, back }, { 1, 0 }, &checker); // center
-	addPlane(scene, { -w, h, front }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { -w, y, back }, { 1, 1 }, { -w, h, back }, { 1, 0 }, &wall1); // left
-	addPlane(scene, { w, h, back }, { 0, 0 }, { w, y, back }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, h, front }, { 1, 0 }, &wall3); // right
-	readModel(scene, "2009210107_3.obj", 1.0, glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &chrome, scene.triangles);
+	addPlane(scene.triangles, { -w, y, back }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, y, back }, { 1, 0 }, &wall2); // floor
+	addPlane(scene.triangles, { -w, h, back }, { 0, 0 }, { -w, y, back }, { 0, 1 }, { w, y, back }, { 1, 1 }, { w, h, back }, { 1, 0 }, &checker); // center
+	addPlane(scene.triangles, { -w, h, front }, { 0, 0 }, { -w, y, front }, { 0, 1 }, { -w, y, back }, { 1, 1 }, { -w, h, back }, { 1, 0 }, &wall1); // left
+	addPlane(scene.triangles, { w, h, back }, { 0, 0 }, { w, y, back }, { 0, 1 }, { w, y, front }, { 1, 1 }, { w, h, front }, { 1, 0 }, &wall3); // right
+	readModel(scene, "2009210107_3.obj", 1.0, glm::rotate(90.0f, Vec3({ 0.0, 1.0, 0.0 })), &chrome, model, params.threads);
+	scene.instances.push_back(makeInstance(model, Mat4()));
 
 	scene.camera.zNear = 0.01;
 	scene.camera.zFar = 10.0;
@@ -567,7 +599,10 @@ static int guiMain() {
 	HWND hCtrl0_7 = CreateWindowEx(0, WC_STATIC, TEXT("Camera Position"), WS_VISIBLE | WS_CHILD | WS_GROUP | SS_LEFT, 8, 16, 120, 15, hwnd, (HMENU)0, hInst, 0);
 	HWND hCtrl0_8 = CreateWindowEx(0, WC_STATIC, TEXT("X:"), WS_VISIBLE | WS_CHILD | WS_GROUP | SS_LEFT, 8, 41, 12, 15, hwnd, (HMENU)0, hInst, 0);
 	HWND hCtrl0_9 = CreateWindowEx(0, WC_BUTTON, TEXT("Preview"), WS_VISIBLE | WS_CHILD | WS_TABSTOP | 0x00000001, 8, 280, 128, 23, hwnd, (HMENU)ID_PREVIEW, hInst, 0);
-	HWND hCtrl0_10 = CreateWindowEx(0, WC_BUTTON, TEXT("Use Octree"), WS_VISIBLE | WS_CHILD | WS_TABSTOP | 0x00000003, 8, 247, 100, 13, hwnd, (HMENU)ID_OCTREE, hInst, 0);
+	// One radio button per AccelType; the static control after them ends the group
+	HWND hCtrl0_32 = CreateWindowEx(0, WC_BUTTON, TEXT("None"), WS_VISIBLE | WS_CHILD | WS_TABSTOP | WS_GROUP | BS_AUTORADIOBUTTON, 8, 247, 60, 13, hwnd, (HMENU)ID_NOACCEL, hInst, 0);
+	HWND hCtrl0_10 = CreateWindowEx(0, WC_BUTTON, TEXT("Octree"), WS_VISIBLE | WS_CHILD | BS_AUTORADIOBUTTON, 75, 247, 70, 13, hwnd, (HMENU)ID_OCTREE, hInst, 0);
+	HWND hCtrl0_31 = CreateWindowEx(0, WC_BUTTON, TEXT("BVH"), WS_VISIBLE | WS_CHILD | BS_AUTORADIOBUTTON, 150, 247, 60, 13, hwnd, (HMENU)ID_BVH, hInst, 0);
 	HWND hCtrl0_11 = CreateWindowEx(0, WC_STATIC, TEXT("Y:"), WS_VISIBLE | WS_CHILD | WS_GROUP | SS_LEFT, 105, 41, 12, 15, hwnd, (HMENU)0, hInst, 0);
 	HWND hCtrl0_12 = CreateWindowEx(0, WC_STATIC, TEXT("Z:"), WS_VISIBLE | WS_CHILD | WS_GROUP | SS_LEFT, 188, 41, 12, 15, hwnd, (HMENU)0, hInst, 0);
 	HWND hCtrl0_5 = CreateWindowEx(0, WC_EDIT, TEXT("0"), WS_VISIBLE | WS_CHILD | WS_TABSTOP | WS_BORDER | ES_AUTOHSCROLL, 23, 41, 53, 20, hwnd, (HMENU)ID_CAMPOSX, hInst, 0);
@@ -593,6 +628,7 @@ static int guiMain() {
 
 	ctrlWnd = hwnd;
 	renderWnd = CreateWindowEx(WS_EX_WINDOWEDGE | WS_EX_DLGMODALFRAME, TEXT("WndClass1"), TEXT("Preview"), WS_CAPTION | WS_SYSMENU, CW_USEDEFAULT, CW_USEDEFAULT, 0, 0, 0, 0, hInst, 0);
+	params.threads = 4;
 	setupGUIScene(scene);
 
 	MSG msg;
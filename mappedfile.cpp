@@ -0,0 +1,69 @@
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "mappedfile.h"
+
+bool mapFile(const char *path, MappedFile &f) {
+	f.data = nullptr;
+#ifdef WIN32
+	f.mapping = NULL;
+	f.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (f.file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(f.file, &size)) {
+		CloseHandle(f.file);
+		return false;
+	}
+	f.size = (size_t)size.QuadPart;
+	// Empty files can't be mapped
+	if (f.size > 0) {
+		f.mapping = CreateFileMappingA(f.file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (f.mapping != NULL)
+			f.data = (const char *)MapViewOfFile(f.mapping, FILE_MAP_READ, 0, 0, 0);
+		if (f.data == nullptr) {
+			if (f.mapping != NULL)
+				CloseHandle(f.mapping);
+			CloseHandle(f.file);
+			return false;
+		}
+	}
+#else
+	f.fd = open(path, O_RDONLY);
+	if (f.fd < 0)
+		return false;
+	struct stat st;
+	if (fstat(f.fd, &st) != 0) {
+		close(f.fd);
+		return false;
+	}
+	f.size = st.st_size;
+	// Empty files can't be mapped
+	if (f.size > 0) {
+		void *p = mmap(nullptr, f.size, PROT_READ, MAP_PRIVATE, f.fd, 0);
+		if (p == MAP_FAILED) {
+			close(f.fd);
+			return false;
+		}
+		f.data = (const char *)p;
+	}
+#endif
+	return true;
+}
+
+void unmapFile(MappedFile &f) {
+#ifdef WIN32
+	if (f.data != nullptr) {
+		UnmapViewOfFile(f.data);
+		CloseHandle(f.mapping);
+	}
+	CloseHandle(f.file);
+#else
+	if (f.data != nullptr)
+		munmap((void *)f.data, f.size);
+	close(f.fd);
+#endif
+}
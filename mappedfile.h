@@ -0,0 +1,19 @@
+#ifdef WIN32
+#define NOMINMAX
+#include <Windows.h>
+#endif
+#include <cstddef>
+
+// Read-only view of a whole file; data is null for an empty file
+struct MappedFile {
+	const char *data;
+	size_t size;
+#ifdef WIN32
+	HANDLE file, mapping;
+#else
+	int fd;
+#endif
+};
+
+bool mapFile(const char *path, MappedFile &f);
+void unmapFile(MappedFile &f);
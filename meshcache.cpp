@@ -0,0 +1,131 @@
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstring>
+#include "renderer.h"
+#include "meshcache.h"
+#include "mappedfile.h"
+
+const unsigned int MESH_CACHE_VERSION = 2; // bump when the file layout or the BVH builder changes
+const char MESH_CACHE_MAGIC[4] = { 'C', 'G', 'T', 'M' };
+const CacheKey HASH_PRIME = 1099511628211ULL;
+
+struct MeshCacheHeader {
+	char magic[4];
+	unsigned int version;
+	CacheKey key;
+	unsigned int vertices, texCoords, indices, nodes, objects;
+};
+
+// FNV-1a over 8-byte words, then over the remaining bytes
+CacheKey hashBytes(const void *data, size_t size, CacheKey seed) {
+	const unsigned char *p = (const unsigned char *)data;
+	CacheKey h = seed;
+	for (; size >= 8; p += 8, size -= 8) {
+		CacheKey word;
+		memcpy(&word, p, 8);
+		h = (h ^ word) * HASH_PRIME;
+	}
+	for (; size > 0; p++, size--)
+		h = (h ^ *p) * HASH_PRIME;
+	return h;
+}
+
+bool hashFile(const char *path, CacheKey &key) {
+	MappedFile file;
+	if (!mapFile(path, file))
+		return false;
+	key = hashBytes(file.data, file.size);
+	unmapFile(file);
+	return true;
+}
+
+std::string meshCachePath(const std::string &source, CacheKey key) {
+	char name[32];
+	sprintf(name, ".%016llx.cache", key);
+	return source + name;
+}
+
+static size_t cacheSize(const MeshCacheHeader &h) {
+	return sizeof(MeshCacheHeader) + (size_t)h.vertices * sizeof(Vec3) + (size_t)h.texCoords * sizeof(glm::vec2) +
+		(size_t)h.indices * sizeof(unsigned int) + (size_t)h.nodes * sizeof(BVHNode) + (size_t)h.objects * sizeof(ObjectId);
+}
+
+template <typename T>
+static const char *readArray(const char *p, unsigned int count, std::vector<T> &v) {
+	v.assign((const T *)p, (const T *)p + count);
+	return p + (size_t)count * sizeof(T);
+}
+
+bool loadMeshCache(const char *path, CacheKey key, Mesh &mesh) {
+	MappedFile file;
+	if (!mapFile(path, file))
+		return false;
+	MeshCacheHeader h;
+	bool ok = file.size >= sizeof(h);
+	if (ok) {
+		memcpy(&h, file.data, sizeof(h));
+		ok = memcmp(h.magic, MESH_CACHE_MAGIC, 4) == 0 && h.version == MESH_CACHE_VERSION && h.key == key &&
+			file.size == cacheSize(h) && h.indices % 3 == 0 && (h.texCoords == 0 || h.texCoords == h.vertices) &&
+			(h.nodes > 0) == (h.objects > 0) && h.objects == h.indices / 3;
+	}
+	if (ok) {
+		// Every array holds 4-byte fields and the header is a multiple of 8 bytes, so the arrays stay aligned
+		const char *p = file.data + sizeof(h);
+		p = readArray(p, h.vertices, mesh.vertices);
+		p = readArray(p, h.texCoords, mesh.texCoords);
+		p = readArray(p, h.indices, mesh.indices);
+		p = readArray(p, h.nodes, mesh.bvh.nodes);
+		readArray(p, h.objects, mesh.bvh.objects);
+		// A damaged or stale file of the right size must not index out of range during traversal
+		ok = checkMesh(mesh);
+		if (ok) {
+			fillMeshBatch(mesh);
+		}
+		else {
+			mesh.vertices.clear();
+			mesh.texCoords.clear();
+			mesh.indices.clear();
+			mesh.bvh.nodes.clear();
+			mesh.bvh.objects.clear();
+		}
+	}
+	unmapFile(file);
+	return ok;
+}
+
+template <typename T>
+static bool writeArray(FILE *f, const std::vector<T> &v) {
+	return v.empty() || fwrite(v.data(), sizeof(T), v.size(), f) == v.size();
+}
+
+bool saveMeshCache(const char *path, CacheKey key, const Mesh &mesh) {
+	MeshCacheHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, MESH_CACHE_MAGIC, 4);
+	h.version = MESH_CACHE_VERSION;
+	h.key = key;
+	h.vertices = mesh.vertices.size();
+	h.texCoords = mesh.texCoords.size();
+	h.indices = mesh.indices.size();
+	h.nodes = mesh.bvh.nodes.size();
+	h.objects = mesh.bvh.objects.size();
+
+	std::string temp = std::string(path) + "." + std::to_string(getpid()) + ".tmp";
+	FILE *f = fopen(temp.c_str(), "wb");
+	if (!f)
+		return false;
+	bool ok = fwrite(&h, sizeof(h), 1, f) == 1 && writeArray(f, mesh.vertices) && writeArray(f, mesh.texCoords) &&
+		writeArray(f, mesh.indices) && writeArray(f, mesh.bvh.nodes) && writeArray(f, mesh.bvh.objects);
+	ok = fclose(f) == 0 && ok;
+	// On Windows the rename fails if another job saved the same cache first, which is just as good
+	if (!ok || rename(temp.c_str(), path) != 0) {
+		remove(temp.c_str());
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,22 @@
+#include <cstddef>
+#include <string>
+
+struct Mesh;
+
+typedef unsigned long long CacheKey;
+
+// Hash of size bytes, continuing from seed so several inputs can be folded into one key
+CacheKey hashBytes(const void *data, size_t size, CacheKey seed = 14695981039346656037ULL);
+// Sets key to the hash of a file's contents; returns false if the file can't be read
+bool hashFile(const char *path, CacheKey &key);
+
+// Cache file for a mesh built from source, named after its key so differently transformed copies don't collide
+std::string meshCachePath(const std::string &source, CacheKey key);
+
+// A cache holds a built mesh: its vertices, texture coordinates, indices and BVH. The header records the format
+// version and the key it was saved under, so a stale cache is ignored. Loading maps the file and copies the arrays
+// without parsing, then checks that every index and BVH range is in bounds; the triangle batch is refilled from
+// the BVH. The material is not stored.
+bool loadMeshCache(const char *path, CacheKey key, Mesh &mesh);
+// Writes a temporary file and renames it into place, so concurrent jobs never read a partial cache
+bool saveMeshCache(const char *path, CacheKey key, const Mesh &mesh);
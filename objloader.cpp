@@ -0,0 +1,307 @@
+#include <cstdlib>
+#include <climits>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+#include "renderer.h"
+#include "objloader.h"
+#include "mappedfile.h"
+#include "threadpool.h"
+
+const size_t OBJ_CHUNK_MIN = 1 << 16; // smallest part of the file parsed as a separate task
+
+static bool isBlank(char c) {
+	return c == ' ' || c == '\t';
+}
+
+static bool isTokenEnd(const char *p, const char *end) {
+	return p == end || isBlank(*p) || *p == '\n' || *p == '\r';
+}
+
+static const char *skipBlanks(const char *p, const char *end) {
+	while (p < end && isBlank(*p))
+		p++;
+	return p;
+}
+
+static const char *nextLine(const char *p, const char *end) {
+	p = (const char *)memchr(p, '\n', end - p);
+	return p ? p + 1 : end;
+}
+
+enum OBJLineType {
+	OBJ_OTHER,
+	OBJ_VERTEX,
+	OBJ_TEXCOORD,
+	OBJ_FACE
+};
+
+// Classifies the line starting at p and moves p past its keyword
+static OBJLineType lineType(const char *&p, const char *end) {
+	p = skipBlanks(p, end);
+	if (p < end && *p == 'v' && isTokenEnd(p + 1, end)) {
+		p += 1;
+		return OBJ_VERTEX;
+	}
+	if (end - p >= 2 && p[0] == 'v' && p[1] == 't' && isTokenEnd(p + 2, end)) {
+		p += 2;
+		return OBJ_TEXCOORD;
+	}
+	if (p < end && *p == 'f' && isTokenEnd(p + 1, end)) {
+		p += 1;
+		return OBJ_FACE;
+	}
+	return OBJ_OTHER;
+}
+
+// Decimal numbers with few significant digits are converted with a single float operation on exactly
+// representable operands, which rounds correctly; anything else is left to strtof. Either way the
+// result is the same as the standard library's.
+static const char *parseFloat(const char *p, const char *end, float &value, bool &ok) {
+	static const float pow10[] = { 1e0f, 1e1f, 1e2f, 1e3f, 1e4f, 1e5f, 1e6f, 1e7f, 1e8f, 1e9f, 1e10f };
+	p = skipBlanks(p, end);
+	const char *start = p;
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	unsigned long long mantissa = 0;
+	int digits = 0, exponent = 0;
+	bool any = false;
+	for (; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+		if (digits < 19) {
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa != 0)
+				digits++;
+		}
+		else
+			exponent++;
+	}
+	if (p < end && *p == '.') {
+		for (p++; p < end && *p >= '0' && *p <= '9'; p++, any = true) {
+			if (digits < 19) {
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa != 0)
+					digits++;
+				exponent--;
+			}
+		}
+	}
+	if (any && p < end && (*p == 'e' || *p == 'E')) {
+		const char *q = p + 1;
+		bool negativeExp = false;
+		if (q < end && (*q == '-' || *q == '+'))
+			negativeExp = *q++ == '-';
+		int e = 0;
+		bool anyExp = false;
+		for (; q < end && *q >= '0' && *q <= '9'; q++, anyExp = true)
+			e = std::min(e * 10 + (*q - '0'), 10000);
+		if (anyExp) {
+			exponent += negativeExp ? -e : e;
+			p = q;
+		}
+	}
+	if (any && isTokenEnd(p, end) && mantissa <= (1 << 24) && exponent >= -10 && exponent <= 10) {
+		float m = (float)mantissa;
+		value = exponent < 0 ? m / pow10[-exponent] : m * pow10[exponent];
+		if (negative)
+			value = -value;
+		return p;
+	}
+
+	while (!isTokenEnd(p, end))
+		p++;
+	char buffer[64];
+	size_t length = std::min((size_t)(p - start), sizeof buffer - 1);
+	memcpy(buffer, start, length);
+	buffer[length] = '\0';
+	char *parsed;
+	value = strtof(buffer, &parsed);
+	if (parsed == buffer)
+		ok = false;
+	return p;
+}
+
+static const char *parseInt(const char *p, const char *end, int &value, bool &ok) {
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+		negative = *p++ == '-';
+	if (p == end || *p < '0' || *p > '9')
+		ok = false;
+	long long v = 0;
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		v = std::min(v * 10 + (*p - '0'), (long long)1 << 31);
+	value = (int)(negative ? -v : std::min(v, (long long)INT_MAX));
+	return p;
+}
+
+// Parses one face corner, "v", "v/vt", "v//vn" or "v/vt/vn"; texCoord is 0 when absent
+static const char *parseCorner(const char *p, const char *end, int &vertex, int &texCoord, bool &ok) {
+	p = parseInt(p, end, vertex, ok);
+	texCoord = 0;
+	if (p < end && *p == '/') {
+		p++;
+		if (p < end && *p != '/')
+			p = parseInt(p, end, texCoord, ok);
+		if (p < end && *p == '/') {
+			int normal;
+			p = parseInt(p + 1, end, normal, ok);
+		}
+	}
+	if (!isTokenEnd(p, end))
+		ok = false;
+	return p;
+}
+
+// OBJ indices are 1-based, or relative to the end of the list when negative
+static int resolveIndex(int index, int defined, int total, bool &ok) {
+	int i = index > 0 ? index - 1 : defined + index;
+	if (index == 0 || i < 0 || i >= total)
+		ok = false;
+	return i;
+}
+
+struct OBJChunk {
+	const char *begin, *end;
+	int vertices, texCoords; // lines of each kind in the chunk
+	int firstVertex, firstTexCoord; // lines of each kind in all earlier chunks
+	std::vector<int> corners, cornerTexCoords; // three per triangle, -1 for no texture coordinate
+	bool ok;
+};
+
+static void countChunk(OBJChunk &chunk) {
+	chunk.vertices = chunk.texCoords = 0;
+	for (const char *p = chunk.begin; p < chunk.end; p = nextLine(p, chunk.end)) {
+		const char *q = p;
+		OBJLineType type = lineType(q, chunk.end);
+		if (type == OBJ_VERTEX)
+			chunk.vertices++;
+		else if (type == OBJ_TEXCOORD)
+			chunk.texCoords++;
+	}
+}
+
+// Vertices and texture coordinates go straight to their final place, faces to the chunk
+static void parseChunk(OBJChunk &chunk, int totalVertices, int totalTexCoords, std::vector<Vec3> &vertices, std::vector<glm::vec2> &texCoords) {
+	const char *end = chunk.end;
+	int v = chunk.firstVertex, vt = chunk.firstTexCoord;
+	chunk.ok = true;
+	for (const char *p = chunk.begin; p < end; p = nextLine(p, end)) {
+		OBJLineType type = lineType(p, end);
+		if (type == OBJ_VERTEX) {
+			Vec3 &pos = vertices[v++];
+			p = parseFloat(p, end, pos.x, chunk.ok);
+			p = parseFloat(p, end, pos.y, chunk.ok);
+			p = parseFloat(p, end, pos.z, chunk.ok);
+		}
+		else if (type == OBJ_TEXCOORD) {
+			glm::vec2 &uv = texCoords[vt++];
+			p = parseFloat(p, end, uv.x, chunk.ok);
+			p = parseFloat(p, end, uv.y, chunk.ok);
+		}
+		else if (type == OBJ_FACE) {
+			// Polygons become triangle fans around their first corner
+			int first[2], prev[2], n = 0;
+			for (p = skipBlanks(p, end); p < end && *p != '\n' && *p != '\r' && *p != '#'; p = skipBlanks(p, end)) {
+				int vertex, texCoord;
+				p = parseCorner(p, end, vertex, texCoord, chunk.ok);
+				int corner[2] = {
+					resolveIndex(vertex, v, totalVertices, chunk.ok),
+					texCoord == 0 ? -1 : resolveIndex(texCoord, vt, totalTexCoords, chunk.ok)
+				};
+				if (n >= 2) {
+					chunk.corners.insert(chunk.corners.end(), { first[0], prev[0], corner[0] });
+					chunk.cornerTexCoords.insert(chunk.cornerTexCoords.end(), { first[1], prev[1], corner[1] });
+				}
+				if (n == 0)
+					std::copy(corner, corner + 2, first);
+				std::copy(corner, corner + 2, prev);
+				n++;
+			}
+			if (n < 3)
+				chunk.ok = false;
+		}
+		if (!chunk.ok)
+			return;
+	}
+}
+
+bool loadOBJ(const char *path, Mesh &mesh, int threads) {
+	MappedFile file;
+	if (!mapFile(path, file))
+		return false;
+	ThreadPool &pool = getThreadPool(threads);
+
+	// Chunks end at line boundaries
+	size_t count = std::max<size_t>(1, std::min(file.size / OBJ_CHUNK_MIN, (size_t)std::max(threads, 1) * 4));
+	std::vector<OBJChunk> chunks(count);
+	const char *begin = file.data, *end = file.data + file.size;
+	for (size_t i = 0; i < count; i++) {
+		chunks[i].begin = i == 0 ? begin : chunks[i - 1].end;
+		chunks[i].end = i == count - 1 ? end : std::max(chunks[i].begin, nextLine(begin + file.size * (i + 1) / count - 1, end));
+	}
+
+	// Relative indices need the number of vertices defined before each line, so count first
+	pool.run(count, threads, [&](int i, int worker) {
+		countChunk(chunks[i]);
+	});
+	int totalVertices = 0, totalTexCoords = 0;
+	for (OBJChunk &chunk : chunks) {
+		chunk.firstVertex = totalVertices;
+		chunk.firstTexCoord = totalTexCoords;
+		totalVertices += chunk.vertices;
+		totalTexCoords += chunk.texCoords;
+	}
+
+	std::vector<glm::vec2> texCoords(totalTexCoords);
+	mesh.vertices.assign(totalVertices, Vec3());
+	pool.run(count, threads, [&](int i, int worker) {
+		parseChunk(chunks[i], totalVertices, totalTexCoords, mesh.vertices, texCoords);
+	});
+	unmapFile(file);
+
+	size_t corners = 0;
+	for (const OBJChunk &chunk : chunks) {
+		if (!chunk.ok) {
+			mesh.vertices.clear();
+			return false;
+		}
+		corners += chunk.corners.size();
+	}
+	mesh.indices.clear();
+	mesh.indices.reserve(corners);
+	std::vector<int> cornerTexCoords;
+	cornerTexCoords.reserve(corners);
+	for (OBJChunk &chunk : chunks) {
+		mesh.indices.insert(mesh.indices.end(), chunk.corners.begin(), chunk.corners.end());
+		cornerTexCoords.insert(cornerTexCoords.end(), chunk.cornerTexCoords.begin(), chunk.cornerTexCoords.end());
+		std::vector<int>().swap(chunk.corners);
+		std::vector<int>().swap(chunk.cornerTexCoords);
+	}
+
+	// Each vertex keeps the first texture coordinate it is used with; a corner with another
+	// coordinate gets a copy of the vertex, shared by all corners with the same pair
+	mesh.texCoords.clear();
+	if (totalTexCoords > 0) {
+		mesh.texCoords.assign(totalVertices, glm::vec2());
+		std::vector<int> vertexTexCoord(totalVertices, -1);
+		std::unordered_map<long long, unsigned int> copies;
+		for (size_t c = 0; c < corners; c++) {
+			unsigned int v = mesh.indices[c];
+			int t = cornerTexCoords[c];
+			if (t < 0 || vertexTexCoord[v] == t)
+				continue;
+			if (vertexTexCoord[v] < 0) {
+				vertexTexCoord[v] = t;
+				mesh.texCoords[v] = texCoords[t];
+				continue;
+			}
+			auto copy = copies.insert({ (long long)v * totalTexCoords + t, (unsigned int)mesh.vertices.size() });
+			if (copy.second) {
+				mesh.vertices.push_back(mesh.vertices[v]);
+				mesh.texCoords.push_back(texCoords[t]);
+			}
+			mesh.indices[c] = copy.first->second;
+		}
+	}
+	return true;
+}
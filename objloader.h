@@ -0,0 +1,7 @@
+struct Mesh;
+
+// Reads the vertices, texture coordinates and faces of a Wavefront OBJ file into mesh. The file is
+// memory-mapped and parsed in chunks on the shared thread pool. Polygons are split into triangle fans,
+// and a vertex used with several texture coordinates is duplicated once per coordinate.
+// Normals, groups and materials are skipped. Returns false if the file can't be read or is malformed.
+bool loadOBJ(const char *path, Mesh &mesh, int threads = 1);
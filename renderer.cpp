@@ -1,11 +1,101 @@
 #include <iostream>
-#include <future>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include "glm/gtc/matrix_transform.hpp"
 #include "glm/gtx/intersect.hpp"
 #include "renderer.h"
+#include "threadpool.h"
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
 
 const int OCTREE_DEPTH = 7;
 const int OCTREE_MAX_OBJ = 100;
+const int OCTREE_PARALLEL_LEVELS = 2;
+const bool OCTREE_CLIP_BOUNDS = true; // clip triangle bounds to each node before testing its children
+const int TILE_SIZE = 16;
+const int PACKET_MAX = 16; // largest RenderParams::packetSize
+const int BVH_BINS = 16;
+const int BVH_MAX_LEAF = 8;
+const int BVH_MAX_DEPTH = 60;
+const float BVH_TRAVERSAL_COST = 1.0f; // relative to the cost of one object test
+const int BVH_TASK_MIN = 4096; // smallest subtree built as a separate task
+const int BUILD_GRAIN = 16384; // objects per chunk in parallel build loops
+const int WAVEFRONT_RAYS = 1 << 16; // primary rays per wave of RenderParams::wavefront
+const int WAVEFRONT_CHUNK = 256; // rays of a wavefront level traced and shaded as one task
+
+// Lanes of the SIMD kernels: one float per triangle of a TriangleBatch, or per ray of a tile row or packet.
+// minLanes and maxLanes return the same operand as std::min and std::max, also for NaNs.
+#if defined(__AVX__)
+const int TRIANGLE_LANES = 8;
+typedef __m256 Lanes;
+typedef __m256 LaneMask;
+static Lanes loadLanes(const float *p) { return _mm256_loadu_ps(p); }
+static Lanes broadcast(float f) { return _mm256_set1_ps(f); }
+static Lanes add(Lanes a, Lanes b) { return _mm256_add_ps(a, b); }
+static Lanes sub(Lanes a, Lanes b) { return _mm256_sub_ps(a, b); }
+static Lanes mul(Lanes a, Lanes b) { return _mm256_mul_ps(a, b); }
+static Lanes div(Lanes a, Lanes b) { return _mm256_div_ps(a, b); }
+static Lanes sqrtLanes(Lanes a) { return _mm256_sqrt_ps(a); }
+static Lanes minLanes(Lanes a, Lanes b) { return _mm256_min_ps(b, a); }
+static Lanes maxLanes(Lanes a, Lanes b) { return _mm256_max_ps(b, a); }
+static LaneMask notLess(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_NLT_UQ); }
+static LaneMask notGreater(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_NGT_UQ); }
+static LaneMask lessEqual(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static LaneMask less(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static LaneMask greaterEqual(Lanes a, Lanes b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+static LaneMask both(LaneMask a, LaneMask b) { return _mm256_and_ps(a, b); }
+static int maskBits(LaneMask m) { return _mm256_movemask_ps(m); }
+static void storeLanes(float *p, Lanes a) { _mm256_storeu_ps(p, a); }
+#elif defined(USE_SSE2)
+const int TRIANGLE_LANES = 4;
+typedef __m128 Lanes;
+typedef __m128 LaneMask;
+static Lanes loadLanes(const float *p) { return _mm_loadu_ps(p); }
+static Lanes broadcast(float f) { return _mm_set1_ps(f); }
+static Lanes add(Lanes a, Lanes b) { return _mm_add_ps(a, b); }
+static Lanes sub(Lanes a, Lanes b) { return _mm_sub_ps(a, b); }
+static Lanes mul(Lanes a, Lanes b) { return _mm_mul_ps(a, b); }
+static Lanes div(Lanes a, Lanes b) { return _mm_div_ps(a, b); }
+static Lanes sqrtLanes(Lanes a) { return _mm_sqrt_ps(a); }
+static Lanes minLanes(Lanes a, Lanes b) { return _mm_min_ps(b, a); }
+static Lanes maxLanes(Lanes a, Lanes b) { return _mm_max_ps(b, a); }
+static LaneMask notLess(Lanes a, Lanes b) { return _mm_cmpnlt_ps(a, b); }
+static LaneMask notGreater(Lanes a, Lanes b) { return _mm_cmpngt_ps(a, b); }
+static LaneMask lessEqual(Lanes a, Lanes b) { return _mm_cmple_ps(a, b); }
+static LaneMask less(Lanes a, Lanes b) { return _mm_cmplt_ps(a, b); }
+static LaneMask greaterEqual(Lanes a, Lanes b) { return _mm_cmpge_ps(a, b); }
+static LaneMask both(LaneMask a, LaneMask b) { return _mm_and_ps(a, b); }
+static int maskBits(LaneMask m) { return _mm_movemask_ps(m); }
+static void storeLanes(float *p, Lanes a) { _mm_storeu_ps(p, a); }
+#else
+const int TRIANGLE_LANES = 1;
+typedef float Lanes;
+typedef bool LaneMask;
+static Lanes loadLanes(const float *p) { return *p; }
+static Lanes broadcast(float f) { return f; }
+static Lanes add(Lanes a, Lanes b) { return a + b; }
+static Lanes sub(Lanes a, Lanes b) { return a - b; }
+static Lanes mul(Lanes a, Lanes b) { return a * b; }
+static Lanes div(Lanes a, Lanes b) { return a / b; }
+static Lanes sqrtLanes(Lanes a) { return sqrtf(a); }
+static Lanes minLanes(Lanes a, Lanes b) { return std::min(a, b); }
+static Lanes maxLanes(Lanes a, Lanes b) { return std::max(a, b); }
+static LaneMask notLess(Lanes a, Lanes b) { return !(a < b); }
+static LaneMask notGreater(Lanes a, Lanes b) { return !(a > b); }
+static LaneMask lessEqual(Lanes a, Lanes b) { return a <= b; }
+static LaneMask less(Lanes a, Lanes b) { return a < b; }
+static LaneMask greaterEqual(Lanes a, Lanes b) { return a >= b; }
+static LaneMask both(LaneMask a, LaneMask b) { return a && b; }
+static int maskBits(LaneMask m) { return m ? 1 : 0; }
+static void storeLanes(float *p, Lanes a) { *p = a; }
+#endif
 
 struct Ray {
 	Vec3 from;
@@ -13,6 +103,7 @@ struct Ray {
 	Vec3 inv_dir;
 
 public:
+	Ray() { }
 	Ray(Vec3 from_, Vec3 dir_) : from(from_), dir(dir_), inv_dir({ 1.0f / dir_.x, 1.0f / dir_.y, 1.0f / dir_.z }) { }
 };
 
@@ -40,6 +131,46 @@ static BoundingBox get_bbox(const Triangle &obj) {
 	return b;
 }
 
+static BoundingBox get_bbox(const Sphere &obj) {
+	BoundingBox b = {
+			obj.center - Vec3(obj.radius),
+			obj.center + Vec3(obj.radius)
+	};
+	return b;
+}
+
+static BoundingBox emptyBox() {
+	float inf = std::numeric_limits<float>::infinity();
+	BoundingBox b = { { inf, inf, inf }, { -inf, -inf, -inf } };
+	return b;
+}
+
+static BoundingBox merge(const BoundingBox &a, const BoundingBox &b) {
+	BoundingBox m = { glm::min(a.min, b.min), glm::max(a.max, b.max) };
+	return m;
+}
+
+static BoundingBox merge(const BoundingBox &a, const Vec3 &p) {
+	BoundingBox m = { glm::min(a.min, p), glm::max(a.max, p) };
+	return m;
+}
+
+static BoundingBox get_bbox(const Instance &instance) {
+	BoundingBox local = instance.mesh->bvh.nodes[0].bounds;
+	BoundingBox b = emptyBox();
+	for (int i = 0; i < 8; i++) {
+		glm::vec4 corner((i & 1) ? local.max.x : local.min.x, (i & 2) ? local.max.y : local.min.y, (i & 4) ? local.max.z : local.min.z, 1.0f);
+		b = merge(b, Vec3(instance.transform * corner));
+	}
+	return b;
+}
+
+static float surfaceArea(const BoundingBox &b) {
+	Vec3 d = b.max - b.min;
+	if (d.x < 0) return 0;
+	return 2.0f * (d.x * d.y + d.y * d.z + d.z * d.x);
+}
+
 static bool overlaps(const BoundingBox &bbox, const BoundingBox &b) {
 	return !((b.max.x < bbox.min.x)
 		|| (b.max.y < bbox.min.y)
@@ -49,59 +180,381 @@ static bool overlaps(const BoundingBox &bbox, const BoundingBox &b) {
 		|| (b.min.z > bbox.max.z));
 }
 
-int stat_emptyNode = 0, stat_overMax = 0, stat_overDepth = 0;
+std::atomic<int> stat_emptyNode(0), stat_overMax(0), stat_overDepth(0);
 
-static void splitOctreeNode(const Scene &scene, OctreeNode *node, int depth) {
-	node->leaf = false;
-	BoundingBox b = node->bounds;
+static void octreeChildBounds(const BoundingBox &b, BoundingBox bboxes[8]) {
 	Vec3 center = (b.min + b.max) / 2.0f;
 	float e = std::numeric_limits<float>().epsilon();
-	BoundingBox bboxes[8] = {
-			{ b.min, { center.x + e, center.y + e, center.z + e } },
-			{ { center.x - e, b.min.y, b.min.z }, { b.max.x, center.y + e, center.z + e } },
-			{ { center.x - e, b.min.y, center.z - e }, { b.max.x, center.y + e, b.max.z } },
-			{ { b.min.x, b.min.y, center.z - e }, { center.x + e, center.y + e, b.max.z } },
-			{ { b.min.x, center.y - e, b.min.z }, { center.x + e, b.max.y, center.z + e } },
-			{ { center.x - e, center.y - e, b.min.z }, { b.max.x, b.max.y, center.z + e } },
-			{ { center.x - e, center.y - e, center.z - e }, b.max },
-			{ { b.min.x, center.y - e, center.z - e }, { center.x + e, b.max.y, b.max.z } }
-	};
+	// Children are indexed by octant bits: 1 = upper half in x, 2 = in y, 4 = in z
 	for (int j = 0; j < 8; j++) {
-		OctreeNode *subnode = new OctreeNode;
-		subnode->leaf = true;
-		subnode->bounds = bboxes[j];
-		int n = 0;
-		for (int i : node->objects) {
-			if (overlaps(subnode->bounds, get_bbox(scene.triangles[i]))) {
-				subnode->objects.push_back(i);
-				n++;
+		for (int k = 0; k < 3; k++) {
+			if (j & (1 << k)) {
+				bboxes[j].min[k] = center[k] - e;
+				bboxes[j].max[k] = b.max[k];
+			}
+			else {
+				bboxes[j].min[k] = b.min[k];
+				bboxes[j].max[k] = center[k] + e;
 			}
 		}
-		if (n == 0) {
-			stat_emptyNode++;
-			delete subnode;
-			subnode = nullptr;
+	}
+}
+
+// Separating axis test (Akenine-Moller) of a triangle against a box
+static bool triangleOverlapsBox(const Triangle &obj, const BoundingBox &bbox) {
+	Vec3 center = (bbox.min + bbox.max) * 0.5f;
+	Vec3 half = (bbox.max - bbox.min) * 0.5f;
+	Vec3 v[3] = { obj.vertex[0] - center, obj.vertex[1] - center, obj.vertex[2] - center };
+	Vec3 edge[3] = { v[1] - v[0], v[2] - v[1], v[0] - v[2] };
+
+	// Box face normals
+	for (int k = 0; k < 3; k++) {
+		if (std::min(std::min(v[0][k], v[1][k]), v[2][k]) > half[k]
+			|| std::max(std::max(v[0][k], v[1][k]), v[2][k]) < -half[k])
+			return false;
+	}
+
+	// Triangle normal
+	Vec3 n = glm::cross(edge[0], edge[1]);
+	if (std::abs(glm::dot(n, v[0])) > glm::dot(half, glm::abs(n)))
+		return false;
+
+	// Cross products of the box axes with the triangle edges
+	for (int i = 0; i < 3; i++) {
+		for (int k = 0; k < 3; k++) {
+			Vec3 axis(0.0f);
+			axis[(k + 1) % 3] = -edge[i][(k + 2) % 3];
+			axis[(k + 2) % 3] = edge[i][(k + 1) % 3];
+			float p0 = glm::dot(v[0], axis), p1 = glm::dot(v[1], axis), p2 = glm::dot(v[2], axis);
+			float r = glm::dot(half, glm::abs(axis));
+			if (std::min(std::min(p0, p1), p2) > r || std::max(std::max(p0, p1), p2) < -r)
+				return false;
 		}
-		else if (depth == OCTREE_DEPTH) {
-			stat_overDepth++;
+	}
+	return true;
+}
+
+// Bounds of the part of a triangle inside bbox, found by clipping it against the six box planes
+static BoundingBox clipTriangleBounds(const Triangle &obj, const BoundingBox &bbox) {
+	// Each plane adds at most one vertex
+	Vec3 poly[9], clipped[9];
+	int n = 3;
+	for (int i = 0; i < 3; i++)
+		poly[i] = obj.vertex[i];
+	for (int plane = 0; plane < 6 && n > 0; plane++) {
+		int k = plane / 2;
+		float sign = plane % 2 == 0 ? 1.0f : -1.0f;
+		float bound = plane % 2 == 0 ? bbox.min[k] : bbox.max[k];
+		int m = 0;
+		for (int i = 0; i < n; i++) {
+			const Vec3 &a = poly[i], &b = poly[(i + 1) % n];
+			float da = sign * (a[k] - bound), db = sign * (b[k] - bound);
+			if (da >= 0)
+				clipped[m++] = a;
+			if ((da >= 0) != (db >= 0))
+				clipped[m++] = a + (b - a) * (da / (da - db));
 		}
-		else if (n < OCTREE_MAX_OBJ) {
-			stat_overMax++;
+		n = m;
+		std::copy(clipped, clipped + n, poly);
+	}
+
+	BoundingBox b = emptyBox();
+	for (int i = 0; i < n; i++)
+		b = merge(b, poly[i]);
+	if (n > 0) {
+		// Intersection points can round slightly outside the box
+		b.min = glm::max(b.min, bbox.min);
+		b.max = glm::min(b.max, bbox.max);
+	}
+	return b;
+}
+
+static bool sphereOverlapsBox(const Sphere &obj, const BoundingBox &bbox) {
+	Vec3 d = obj.center - glm::clamp(obj.center, bbox.min, bbox.max);
+	return glm::dot(d, d) <= obj.radius * obj.radius;
+}
+
+struct OctreeBuilder {
+	const std::vector<Triangle> &triangles;
+	const std::vector<Sphere> &spheres;
+	const std::vector<BoundingBox> &bounds; // of the triangles
+	const std::vector<BoundingBox> &instanceBounds;
+};
+
+// Bounds of objects [begin, end) of a node, clipped to the node when OCTREE_CLIP_BOUNDS is set
+static void nodeObjectBounds(const OctreeBuilder &builder, const std::vector<ObjectId> &objects, const BoundingBox &nodeBounds, int begin, int end, std::vector<BoundingBox> &bounds) {
+	for (int k = begin; k < end; k++) {
+		const ObjectId &id = objects[k];
+		if (id.type != TRIANGLE) {
+			BoundingBox b = id.type == SPHERE ? get_bbox(builder.spheres[id.index]) : builder.instanceBounds[id.index];
+			if (OCTREE_CLIP_BOUNDS) {
+				b.min = glm::max(b.min, nodeBounds.min);
+				b.max = glm::min(b.max, nodeBounds.max);
+			}
+			bounds[k] = b;
 		}
-		else {
-			splitOctreeNode(scene, subnode, depth + 1);
+		else if (OCTREE_CLIP_BOUNDS)
+			bounds[k] = clipTriangleBounds(builder.triangles[id.index], nodeBounds);
+		else
+			bounds[k] = builder.bounds[id.index];
+	}
+}
+
+// Appends the objects [begin, end) that overlap a child's bounds to out, which may be objects itself.
+// objectBounds holds the bounds of each object at the same index. Returns the number appended.
+static int childObjects(const OctreeBuilder &builder, const std::vector<ObjectId> &objects, const std::vector<BoundingBox> &objectBounds, int begin, int end, const BoundingBox &bounds, std::vector<ObjectId> &out) {
+	size_t size = out.size();
+	// The exact test gets a little slack so that objects touching a face are never dropped; instances only
+	// have their box
+	BoundingBox testBounds = extend(bounds, (bounds.max.x - bounds.min.x) * 1e-5f);
+	for (int k = begin; k < end; k++) {
+		ObjectId id = objects[k];
+		if (overlaps(bounds, objectBounds[k]) && (id.type == INSTANCE ||
+			(id.type == SPHERE ? sphereOverlapsBox(builder.spheres[id.index], testBounds) : triangleOverlapsBox(builder.triangles[id.index], testBounds))))
+			out.push_back(id);
+	}
+	if (out.size() == size)
+		stat_emptyNode++;
+	return out.size() - size;
+}
+
+static bool shouldSplitOctreeNode(int count, int depth) {
+	if (depth == OCTREE_DEPTH) {
+		stat_overDepth++;
+		return false;
+	}
+	if (count < OCTREE_MAX_OBJ) {
+		stat_overMax++;
+		return false;
+	}
+	return true;
+}
+
+static OctreeNode octreeNode(const BoundingBox &bounds) {
+	OctreeNode node;
+	node.bounds = bounds;
+	std::fill(node.subnodes, node.subnodes + 8, -1);
+	node.offset = node.count = node.triangles = node.spheres = 0;
+	return node;
+}
+
+// Objects and their bounds for the nodes on the path being built; each node's follow its parent's.
+// The vectors only grow, so a subtree is built without allocating once they are large enough.
+struct OctreeScratch {
+	std::vector<ObjectId> objects;
+	std::vector<BoundingBox> bounds;
+};
+
+static void appendObjects(const std::vector<ObjectId> &objects, int begin, int end, ObjectType type, std::vector<ObjectId> &out) {
+	for (int k = begin; k < end; k++) {
+		if (objects[k].type == type)
+			out.push_back(objects[k]);
+	}
+}
+
+// Appends a node over scratch.objects[begin, end()) to tree and, if split, its subtree depth first.
+// Returns the node's index.
+static int addOctreeNode(const OctreeBuilder &builder, Octree &tree, OctreeScratch &scratch, int begin, const BoundingBox &bounds, bool split, int depth) {
+	int index = tree.nodes.size();
+	tree.nodes.push_back(octreeNode(bounds));
+	int end = scratch.objects.size();
+	if (!split) {
+		OctreeNode &node = tree.nodes[index];
+		node.offset = tree.objects.size();
+		appendObjects(scratch.objects, begin, end, TRIANGLE, tree.objects);
+		node.triangles = tree.objects.size() - node.offset;
+		appendObjects(scratch.objects, begin, end, SPHERE, tree.objects);
+		node.spheres = tree.objects.size() - node.offset - node.triangles;
+		appendObjects(scratch.objects, begin, end, INSTANCE, tree.objects);
+		node.count = tree.objects.size() - node.offset;
+		return index;
+	}
+
+	BoundingBox bboxes[8];
+	octreeChildBounds(bounds, bboxes);
+	scratch.bounds.resize(end);
+	nodeObjectBounds(builder, scratch.objects, bounds, begin, end, scratch.bounds);
+	for (int j = 0; j < 8; j++) {
+		int count = childObjects(builder, scratch.objects, scratch.bounds, begin, end, bboxes[j], scratch.objects);
+		if (count > 0) {
+			int child = addOctreeNode(builder, tree, scratch, end, bboxes[j], shouldSplitOctreeNode(count, depth), depth + 1);
+			tree.nodes[index].subnodes[j] = child;
+		}
+		scratch.objects.resize(end);
+	}
+	return index;
+}
+
+// Copies triangle(i) for the given indices into batch, padded so that the kernel can load whole
+// lanes past the end. An index of -1 leaves an empty slot, which never reports a hit.
+template <typename GetTriangle>
+static void fillTriangleBatch(TriangleBatch &batch, const std::vector<int> &indices, GetTriangle triangle) {
+	int size = indices.size() + TRIANGLE_LANES - 1;
+	for (int k = 0; k < 3; k++) {
+		batch.v0[k].assign(size, 0.0f);
+		batch.e1[k].assign(size, 0.0f);
+		batch.e2[k].assign(size, 0.0f);
+	}
+	batch.index = indices;
+	batch.transparent.assign(indices.size(), 0);
+	for (int j = 0; j < indices.size(); j++) {
+		if (indices[j] < 0)
+			continue;
+		const Triangle &obj = triangle(indices[j]);
+		batch.transparent[j] = obj.material && obj.material->refract;
+		Vec3 e1 = obj.vertex[1] - obj.vertex[0];
+		Vec3 e2 = obj.vertex[2] - obj.vertex[0];
+		for (int k = 0; k < 3; k++) {
+			batch.v0[k][j] = obj.vertex[0][k];
+			batch.e1[k][j] = e1[k];
+			batch.e2[k][j] = e2[k];
+		}
+	}
+}
+
+// A node of the top OCTREE_PARALLEL_LEVELS levels, which are split breadth first. The subtrees below them
+// are then built by separate tasks into trees of their own, and copied into place.
+struct OctreeTopNode {
+	BoundingBox bounds;
+	int depth;
+	bool split; // whether the node is to be split
+	bool expanded; // whether its children were made at the top levels
+	std::vector<ObjectId> objects;
+	int subnodes[8]; // indices of the children among the top nodes, or -1
+	Octree subtree; // when not expanded
+};
+
+// Appends top node i and everything below it to tree, depth first; returns its index in tree
+static int placeOctreeNode(std::vector<OctreeTopNode> &top, int i, Octree &tree) {
+	OctreeTopNode &node = top[i];
+	int index = tree.nodes.size();
+	if (!node.expanded) {
+		int objectOffset = tree.objects.size();
+		for (OctreeNode n : node.subtree.nodes) {
+			for (int j = 0; j < 8; j++) {
+				if (n.subnodes[j] >= 0)
+					n.subnodes[j] += index;
+			}
+			n.offset += objectOffset;
+			tree.nodes.push_back(n);
+		}
+		tree.objects.insert(tree.objects.end(), node.subtree.objects.begin(), node.subtree.objects.end());
+		return index;
+	}
+	tree.nodes.push_back(octreeNode(node.bounds));
+	for (int j = 0; j < 8; j++) {
+		if (node.subnodes[j] >= 0) {
+			int child = placeOctreeNode(top, node.subnodes[j], tree);
+			tree.nodes[index].subnodes[j] = child;
 		}
-		node->subnodes[j] = subnode;
 	}
+	return index;
 }
 
-void buildOctree(Scene &scene) {
+void buildOctree(Scene &scene, int threads, BuildStats *stats) {
+	auto start = std::chrono::steady_clock::now();
+	ThreadPool &pool = getThreadPool(threads);
+	destroyOctree(scene);
+	stat_emptyNode = stat_overMax = stat_overDepth = 0;
+
 	float size = 10;
-	scene.octreeRoot.bounds.min = { -size, -size, -size };
-	scene.octreeRoot.bounds.max = { size, size, size };
+	BoundingBox rootBounds = { { -size, -size, -size }, { size, size, size } };
+	std::vector<BoundingBox> objectBounds(scene.triangles.size());
+	pool.parallelFor(scene.triangles.size(), threads, BUILD_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			objectBounds[i] = get_bbox(scene.triangles[i]);
+	});
+	// Spheres and instances are not scanned on their own, so the root grows to hold any that reach outside it
+	for (int i = 0; i < scene.spheres.size(); i++)
+		rootBounds = merge(rootBounds, get_bbox(scene.spheres[i]));
+	std::vector<BoundingBox> instanceBounds(scene.instances.size());
+	for (int i = 0; i < scene.instances.size(); i++) {
+		if (scene.instances[i].mesh->bvh.nodes.empty())
+			continue;
+		instanceBounds[i] = get_bbox(scene.instances[i]);
+		rootBounds = merge(rootBounds, instanceBounds[i]);
+	}
+	OctreeBuilder builder = { scene.triangles, scene.spheres, objectBounds, instanceBounds };
+
+	std::vector<OctreeTopNode> top(1);
+	top[0].bounds = rootBounds;
+	top[0].depth = 0;
+	top[0].split = true;
+	top[0].expanded = false;
 	for (int i = 0; i < scene.triangles.size(); i++)
-		scene.octreeRoot.objects.push_back(i);
-	splitOctreeNode(scene, &scene.octreeRoot, 0);
+		top[0].objects.push_back({ TRIANGLE, i });
+	for (int i = 0; i < scene.spheres.size(); i++)
+		top[0].objects.push_back({ SPHERE, i });
+	for (int i = 0; i < scene.instances.size(); i++) {
+		if (!scene.instances[i].mesh->bvh.nodes.empty())
+			top[0].objects.push_back({ INSTANCE, i });
+	}
+
+	// The top levels are split with one task per child, then every remaining subtree is a task
+	std::vector<int> frontier = { 0 };
+	for (int level = 0; level < OCTREE_PARALLEL_LEVELS && !frontier.empty(); level++) {
+		std::vector<std::vector<BoundingBox>> nodeBounds(frontier.size());
+		for (int f = 0; f < frontier.size(); f++) {
+			const OctreeTopNode &node = top[frontier[f]];
+			nodeBounds[f].resize(node.objects.size());
+			pool.parallelFor(node.objects.size(), threads, BUILD_GRAIN, [&](int begin, int end) {
+				nodeObjectBounds(builder, node.objects, node.bounds, begin, end, nodeBounds[f]);
+			});
+		}
+		std::vector<std::vector<ObjectId>> children(frontier.size() * 8);
+		pool.run(children.size(), threads, [&](int t, int worker) {
+			const OctreeTopNode &node = top[frontier[t / 8]];
+			BoundingBox bboxes[8];
+			octreeChildBounds(node.bounds, bboxes);
+			childObjects(builder, node.objects, nodeBounds[t / 8], 0, node.objects.size(), bboxes[t % 8], children[t]);
+		});
+		std::vector<int> next;
+		for (int t = 0; t < children.size(); t++) {
+			int parent = frontier[t / 8];
+			top[parent].expanded = true;
+			top[parent].subnodes[t % 8] = -1;
+			if (children[t].empty())
+				continue;
+			BoundingBox bboxes[8];
+			octreeChildBounds(top[parent].bounds, bboxes);
+			OctreeTopNode child;
+			child.bounds = bboxes[t % 8];
+			child.depth = top[parent].depth + 1;
+			child.split = shouldSplitOctreeNode(children[t].size(), top[parent].depth);
+			child.expanded = false;
+			child.objects.swap(children[t]);
+			top[parent].subnodes[t % 8] = top.size();
+			if (child.split)
+				next.push_back(top.size());
+			top.push_back(std::move(child));
+		}
+		frontier.swap(next);
+	}
+
+	std::vector<int> tasks;
+	for (int i = 0; i < top.size(); i++) {
+		if (!top[i].expanded)
+			tasks.push_back(i);
+	}
+	pool.run(tasks.size(), threads, [&](int t, int worker) {
+		OctreeTopNode &node = top[tasks[t]];
+		OctreeScratch scratch;
+		scratch.objects.swap(node.objects);
+		addOctreeNode(builder, node.subtree, scratch, 0, node.bounds, node.split, node.depth);
+	});
+
+	Octree &tree = scene.octree;
+	placeOctreeNode(top, 0, tree);
+	std::vector<int> order(tree.objects.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = tree.objects[i].type == TRIANGLE ? tree.objects[i].index : -1;
+	fillTriangleBatch(tree.batch, order, [&](int i) -> const Triangle & { return scene.triangles[i]; });
+
+	if (stats) {
+		stats->buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats->nodes = tree.nodes.size();
+		stats->references = tree.objects.size();
+	}
 	/*
 	std::cout << "built octree: empty=" << stat_emptyNode <<
 		" overDepth=" << stat_overDepth <<
@@ -109,255 +562,2406 @@ void buildOctree(Scene &scene) {
 	*/
 }
 
-static void deleteNode(OctreeNode *node) {
-	if (!node->leaf) {
-		for (int i = 0; i < 8; i++) {
-			if (node->subnodes[i] != nullptr) {
-				deleteNode(node->subnodes[i]);
-				delete node->subnodes[i];
-				node->subnodes[i] = nullptr;
+// The arrays keep their memory for the next build
+void destroyOctree(Scene &scene) {
+	scene.octree.nodes.clear();
+	scene.octree.objects.clear();
+}
+
+struct BVHBuilder {
+	const std::vector<BoundingBox> &bounds;
+	std::vector<Vec3> centroids;
+	std::vector<int> order;
+	ThreadPool &pool;
+	int threads; // workers of the pool to use
+
+	BVHBuilder(const std::vector<BoundingBox> &bounds_, ThreadPool &pool_, int threads_) : bounds(bounds_), pool(pool_), threads(threads_) { }
+};
+
+struct BVHBins {
+	int counts[3][BVH_BINS];
+	BoundingBox bounds[3][BVH_BINS];
+};
+
+static int bvhBin(const BoundingBox &cb, int axis, const Vec3 &c) {
+	float extent = cb.max[axis] - cb.min[axis];
+	int bin = (int)((c[axis] - cb.min[axis]) * BVH_BINS / extent);
+	return std::min(std::max(bin, 0), BVH_BINS - 1);
+}
+
+static void initBins(BVHBins &bins) {
+	for (int axis = 0; axis < 3; axis++) {
+		for (int i = 0; i < BVH_BINS; i++) {
+			bins.counts[axis][i] = 0;
+			bins.bounds[axis][i] = emptyBox();
+		}
+	}
+}
+
+static void fillBins(const BVHBuilder &builder, int begin, int end, const BoundingBox &cb, BVHBins &bins) {
+	for (int i = begin; i < end; i++) {
+		int o = builder.order[i];
+		for (int axis = 0; axis < 3; axis++) {
+			if (cb.max[axis] <= cb.min[axis])
+				continue;
+			int bin = bvhBin(cb, axis, builder.centroids[o]);
+			bins.counts[axis][bin]++;
+			bins.bounds[axis][bin] = merge(bins.bounds[axis][bin], builder.bounds[o]);
+		}
+	}
+}
+
+// Binned SAH: cost of a split is relative to testing all n objects in a leaf.
+// Returns false if no split beats making a leaf.
+static bool chooseSplit(const BVHBins &bins, const BoundingBox &b, const BoundingBox &cb, int n, int &bestAxis, int &bestBin) {
+	bestAxis = -1;
+	float bestCost = std::numeric_limits<float>::max();
+	float parentArea = surfaceArea(b);
+	for (int axis = 0; axis < 3; axis++) {
+		if (cb.max[axis] <= cb.min[axis])
+			continue;
+		float rightArea[BVH_BINS];
+		int rightCount[BVH_BINS];
+		BoundingBox acc = emptyBox();
+		int count = 0;
+		for (int i = BVH_BINS - 1; i > 0; i--) {
+			acc = merge(acc, bins.bounds[axis][i]);
+			count += bins.counts[axis][i];
+			rightArea[i] = surfaceArea(acc);
+			rightCount[i] = count;
+		}
+		acc = emptyBox();
+		count = 0;
+		for (int i = 1; i < BVH_BINS; i++) {
+			acc = merge(acc, bins.bounds[axis][i - 1]);
+			count += bins.counts[axis][i - 1];
+			if (count == 0 || rightCount[i] == 0)
+				continue;
+			float cost = BVH_TRAVERSAL_COST + (surfaceArea(acc) * count + rightArea[i] * rightCount[i]) / parentArea;
+			if (cost < bestCost) {
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = i;
 			}
 		}
 	}
+	return bestAxis >= 0 && (n > BVH_MAX_LEAF || bestCost < n);
 }
 
-void destroyOctree(Scene &scene) {
-	scene.octreeRoot.objects.clear();
-	deleteNode(&scene.octreeRoot);
+static void rangeBounds(const BVHBuilder &builder, int begin, int end, BoundingBox &b, BoundingBox &cb) {
+	b = emptyBox();
+	cb = emptyBox();
+	for (int i = begin; i < end; i++) {
+		b = merge(b, builder.bounds[builder.order[i]]);
+		cb = merge(cb, builder.centroids[builder.order[i]]);
+	}
 }
 
-static bool intersectBboxRay(const BoundingBox &bbox, const Ray &ray) {
-	Vec3 a = (bbox.min - ray.from) * ray.inv_dir;
-	Vec3 b = (bbox.max - ray.from) * ray.inv_dir;
+// Serial builder for one subtree; right child offsets are relative to the start of nodes
+static int buildBVHNode(BVHBuilder &builder, std::vector<BVHNode> &nodes, int begin, int end, int depth) {
+	int index = nodes.size();
+	nodes.push_back(BVHNode());
+	BoundingBox b, cb;
+	rangeBounds(builder, begin, end, b, cb);
+	nodes[index].bounds = b;
+	nodes[index].offset = begin;
+	nodes[index].count = end - begin;
 
-	float tmin = std::max(std::max(std::min(a[0], b[0]), std::min(a[1], b[1])), std::min(a[2], b[2]));
-	float tmax = std::min(std::min(std::max(a[0], b[0]), std::max(a[1], b[1])), std::max(a[2], b[2]));
+	int n = end - begin;
+	if (n == 1 || depth == BVH_MAX_DEPTH)
+		return index;
 
-	// if tmax < 0, ray (line) is intersecting AABB, but whole AABB is behind us
-	if (tmax < 0)
-		return false;
+	BVHBins bins;
+	initBins(bins);
+	fillBins(builder, begin, end, cb, bins);
+	int axis, bin;
+	if (!chooseSplit(bins, b, cb, n, axis, bin))
+		return index;
 
-	// if tmin > tmax, ray doesn't intersect AABB
-	if (tmin > tmax)
-		return false;
+	// Stable like the parallel partition of the top levels, so the tree doesn't depend on the thread count
+	int *first = &builder.order[0];
+	int mid = std::stable_partition(first + begin, first + end, [&](int o) {
+		return bvhBin(cb, axis, builder.centroids[o]) < bin;
+	}) - first;
 
-	return true;
+	buildBVHNode(builder, nodes, begin, mid, depth + 1);
+	int right = buildBVHNode(builder, nodes, mid, end, depth + 1);
+	nodes[index].offset = right;
+	nodes[index].count = 0;
+	return index;
 }
 
-static bool findNode(const Scene &scene, const OctreeNode *node, const Ray &ray, const int excludeId, int &nearestId, float &nearestDist) {
-	bool found = false;
-	if (!node->leaf) {
-		for (OctreeNode *subnode : node->subnodes) {
-			// Early pruning!
-			if (subnode == nullptr || !intersectBboxRay(subnode->bounds, ray))
-				continue;
+// Node of the top levels of a parallel build. Below them, whole subtrees are built as separate
+// tasks and spliced into the depth-first node array once they are all done.
+struct BVHTopNode {
+	BVHNode node;
+	int left, right; // top nodes, -1 for leaves and subtrees
+	int subtree; // task building this node's subtree, or -1
+};
 
-			if (findNode(scene, subnode, ray, excludeId, nearestId, nearestDist))
-				found = true;
-		}
+struct BVHSubtree {
+	int begin, end, depth;
+	std::vector<BVHNode> nodes;
+};
+
+static int buildBVHTop(BVHBuilder &builder, std::vector<BVHTopNode> &top, std::vector<BVHSubtree> &subtrees, int taskSize, int begin, int end, int depth) {
+	int index = top.size();
+	top.push_back({ BVHNode(), -1, -1, -1 });
+	int n = end - begin;
+	if (n <= taskSize) {
+		top[index].subtree = subtrees.size();
+		subtrees.push_back({ begin, end, depth });
+		return index;
 	}
-	else {
-		Vec3 baryPos;
-		for (int i : node->objects) {
-			if (i == excludeId) continue;
-			const Triangle &obj = scene.triangles[i];
-			if (glm::intersectRayTriangle(ray.from, ray.dir, obj.vertex[0], obj.vertex[1], obj.vertex[2], baryPos)) {
-				if (baryPos.z < nearestDist) {
-					found = true;
-					nearestDist = baryPos.z;
-					nearestId = i;
-				}
+
+	// Bounds and bins are gathered per chunk in parallel and then merged
+	int chunks = (n + BUILD_GRAIN - 1) / BUILD_GRAIN;
+	std::vector<BoundingBox> chunkBounds(chunks), chunkCentroids(chunks);
+	builder.pool.run(chunks, builder.threads, [&](int c, int worker) {
+		rangeBounds(builder, begin + (int)((long long)n * c / chunks), begin + (int)((long long)n * (c + 1) / chunks), chunkBounds[c], chunkCentroids[c]);
+	});
+	BoundingBox b = emptyBox(), cb = emptyBox();
+	for (int c = 0; c < chunks; c++) {
+		b = merge(b, chunkBounds[c]);
+		cb = merge(cb, chunkCentroids[c]);
+	}
+	top[index].node.bounds = b;
+	top[index].node.offset = begin;
+	top[index].node.count = n;
+
+	std::vector<BVHBins> chunkBins(chunks);
+	builder.pool.run(chunks, builder.threads, [&](int c, int worker) {
+		initBins(chunkBins[c]);
+		fillBins(builder, begin + (int)((long long)n * c / chunks), begin + (int)((long long)n * (c + 1) / chunks), cb, chunkBins[c]);
+	});
+	BVHBins bins;
+	initBins(bins);
+	for (int c = 0; c < chunks; c++) {
+		for (int axis = 0; axis < 3; axis++) {
+			for (int i = 0; i < BVH_BINS; i++) {
+				bins.counts[axis][i] += chunkBins[c].counts[axis][i];
+				bins.bounds[axis][i] = merge(bins.bounds[axis][i], chunkBins[c].bounds[axis][i]);
 			}
 		}
 	}
-	return found;
-}
+	int axis, bin;
+	if (depth == BVH_MAX_DEPTH || !chooseSplit(bins, b, cb, n, axis, bin))
+		return index;
 
-static bool intersectRaySphere(const Ray &ray, const Vec3 &center, float radius, float &distance) {
-	float len = glm::dot(ray.dir, center - ray.from);
-	if (len < 0.f) // behind the ray
-		return false;
-	Vec3 d = center - (ray.from + ray.dir * len);
-	float dst2 = glm::dot(d, d);
-	float r2 = radius * radius;
-	if (dst2 > r2) return false;
-	distance = len - sqrt(r2 - dst2);
-	return true;
+	// Parallel stable partition: count per chunk, then scatter into a copy
+	std::vector<int> leftCounts(chunks);
+	builder.pool.run(chunks, builder.threads, [&](int c, int worker) {
+		int count = 0;
+		for (int i = begin + (int)((long long)n * c / chunks); i < begin + (int)((long long)n * (c + 1) / chunks); i++) {
+			if (bvhBin(cb, axis, builder.centroids[builder.order[i]]) < bin)
+				count++;
+		}
+		leftCounts[c] = count;
+	});
+	std::vector<int> leftOffsets(chunks), rightOffsets(chunks);
+	int left = 0, right = 0;
+	for (int c = 0; c < chunks; c++) {
+		leftOffsets[c] = left;
+		rightOffsets[c] = right;
+		left += leftCounts[c];
+		right += (int)((long long)n * (c + 1) / chunks) - (int)((long long)n * c / chunks) - leftCounts[c];
+	}
+	std::vector<int> partitioned(n);
+	builder.pool.run(chunks, builder.threads, [&](int c, int worker) {
+		int l = leftOffsets[c], r = left + rightOffsets[c];
+		for (int i = begin + (int)((long long)n * c / chunks); i < begin + (int)((long long)n * (c + 1) / chunks); i++) {
+			int o = builder.order[i];
+			if (bvhBin(cb, axis, builder.centroids[o]) < bin)
+				partitioned[l++] = o;
+			else
+				partitioned[r++] = o;
+		}
+	});
+	std::copy(partitioned.begin(), partitioned.end(), builder.order.begin() + begin);
+
+	int leftChild = buildBVHTop(builder, top, subtrees, taskSize, begin, begin + left, depth + 1);
+	int rightChild = buildBVHTop(builder, top, subtrees, taskSize, begin + left, end, depth + 1);
+	top[index].left = leftChild;
+	top[index].right = rightChild;
+	top[index].node.count = 0;
+	return index;
 }
 
-static bool _findNearestObject(const Scene &scene, const RenderParams &params, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
-	bool found = false;
-	for (int i = 0; i < scene.spheres.size(); i++) {
-		if (excludeObjectID.type == SPHERE && i == excludeObjectID.index)
-			continue;
-		const Sphere &obj = scene.spheres[i];
-		if (excludeTransparentMat && obj.material->refract)
-			continue;
-		float distance;
-		if (intersectRaySphere(ray, obj.center, obj.radius, distance)) {
-			if (distance < nearestDist) {
-				found = true;
-				nearestDist = distance;
-				nearestObjectID.type = SPHERE;
-				nearestObjectID.index = i;
-				isInside = glm::distance(ray.from, obj.center) < obj.radius;
-			}
+static void flattenBVH(const std::vector<BVHTopNode> &top, const std::vector<BVHSubtree> &subtrees, int index, std::vector<BVHNode> &nodes) {
+	const BVHTopNode &t = top[index];
+	if (t.subtree >= 0) {
+		int base = nodes.size();
+		for (BVHNode node : subtrees[t.subtree].nodes) {
+			if (node.count == 0)
+				node.offset += base;
+			nodes.push_back(node);
 		}
+		return;
 	}
-	if (params.enableOctree) {
-		if (findNode(scene, &scene.octreeRoot, ray, excludeObjectID.type == TRIANGLE ? excludeObjectID.index : -1, nearestObjectID.index, nearestDist)) {
-			found = true;
-			nearestObjectID.type = TRIANGLE;
-			isInside = false;
+	int i = nodes.size();
+	nodes.push_back(t.node);
+	if (t.left >= 0) {
+		flattenBVH(top, subtrees, t.left, nodes);
+		nodes[i].offset = nodes.size();
+		flattenBVH(top, subtrees, t.right, nodes);
+	}
+}
+
+static void buildBVH(BVH &bvh, const std::vector<ObjectId> &objects, const std::vector<BoundingBox> &bounds, int threads) {
+	bvh.nodes.clear();
+	bvh.objects.clear();
+	if (objects.empty())
+		return;
+	int n = objects.size();
+	BVHBuilder builder(bounds, getThreadPool(threads), threads);
+	builder.centroids.resize(n);
+	builder.order.resize(n);
+	builder.pool.parallelFor(n, builder.threads, BUILD_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			builder.centroids[i] = (bounds[i].min + bounds[i].max) * 0.5f;
+			builder.order[i] = i;
 		}
+	});
+
+	// Split the top levels in parallel until there are enough subtrees to keep every thread busy
+	int taskSize = threads > 1 ? std::max(BVH_TASK_MIN, n / (threads * 4)) : n;
+	std::vector<BVHTopNode> top;
+	std::vector<BVHSubtree> subtrees;
+	buildBVHTop(builder, top, subtrees, taskSize, 0, n, 0);
+	builder.pool.run(subtrees.size(), builder.threads, [&](int t, int worker) {
+		BVHSubtree &subtree = subtrees[t];
+		subtree.nodes.reserve((subtree.end - subtree.begin) * 2);
+		buildBVHNode(builder, subtree.nodes, subtree.begin, subtree.end, subtree.depth);
+	});
+
+	bvh.nodes.reserve(n * 2);
+	flattenBVH(top, subtrees, 0, bvh.nodes);
+	bvh.objects.resize(n);
+	builder.pool.parallelFor(n, builder.threads, BUILD_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; i++)
+			bvh.objects[i] = objects[builder.order[i]];
+	});
+}
+
+// Fills wide node index from the binary subtree under node. Inner children are opened, the largest first,
+// until the wide node has BVH_WIDTH children; children stay in tree order.
+static void collapseBVHNode(BVH &bvh, int node, int index) {
+	int children[BVH_WIDTH];
+	int n = 0;
+	if (bvh.nodes[node].count > 0) {
+		children[n++] = node;
 	}
 	else {
-		for (int i = 0; i < scene.triangles.size(); i++) {
-			if (excludeObjectID.type == TRIANGLE && i == excludeObjectID.index)
-				continue;
-			const Triangle &obj = scene.triangles[i];
-			if (excludeTransparentMat && obj.material->refract)
-				continue;
-			Vec3 baryPos;
-			if (glm::intersectRayTriangle(ray.from, ray.dir, obj.vertex[0], obj.vertex[1], obj.vertex[2], baryPos)) {
-				// See https://github.com/g-truc/glm/issues/6
-				float distance = baryPos.z;
-				if (distance < nearestDist) {
-					found = true;
-					nearestDist = distance;
-					nearestObjectID.type = TRIANGLE;
-					nearestObjectID.index = i;
-					isInside = false;
-				}
+		children[n++] = node + 1;
+		children[n++] = bvh.nodes[node].offset;
+	}
+	while (n < BVH_WIDTH) {
+		int best = -1;
+		float bestArea = 0;
+		for (int c = 0; c < n; c++) {
+			const BVHNode &child = bvh.nodes[children[c]];
+			if (child.count == 0 && (best < 0 || surfaceArea(child.bounds) > bestArea)) {
+				best = c;
+				bestArea = surfaceArea(child.bounds);
 			}
 		}
+		if (best < 0)
+			break;
+		int opened = children[best];
+		std::copy_backward(children + best + 1, children + n, children + n + 1);
+		children[best] = opened + 1;
+		children[best + 1] = bvh.nodes[opened].offset;
+		n++;
 	}
-	return found;
-}
 
-static bool findNearestObject(const Scene &scene, const RenderParams &params, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, Vec3 &nearestPos, Vec3 &nearestNorm, Material **nearestMat, bool &isInside) {
-	float nearestDist = std::numeric_limits<float>::max();
-	if (_findNearestObject(scene, params, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside)) {
-		if (nearestObjectID.type == SPHERE) {
-			const Sphere &obj = scene.spheres[nearestObjectID.index];
-			nearestPos = ray.from + ray.dir * nearestDist;
-			nearestNorm = (nearestPos - obj.center) / obj.radius;
-			*nearestMat = obj.material;
-		}
-		else if (nearestObjectID.type == TRIANGLE) {
-			const Triangle &obj = scene.triangles[nearestObjectID.index];
-			nearestPos = ray.from + ray.dir * nearestDist;
-			nearestNorm = obj.norm;
-			*nearestMat = obj.material;
-			isInside = false;
+	WideBVHNode &wide = bvh.wide[index];
+	wide = WideBVHNode();
+	wide.children = n;
+	for (int c = 0; c < n; c++) {
+		const BVHNode &child = bvh.nodes[children[c]];
+		for (int k = 0; k < 3; k++) {
+			wide.min[k][c] = child.bounds.min[k];
+			wide.max[k][c] = child.bounds.max[k];
 		}
-		return true;
+		wide.offset[c] = child.offset;
+		wide.count[c] = child.count;
+	}
+	// Depth-first, so the wide nodes of a subtree are contiguous like the binary ones
+	for (int c = 0; c < n; c++) {
+		if (bvh.nodes[children[c]].count > 0)
+			continue;
+		int next = bvh.wide.size();
+		bvh.wide.push_back(WideBVHNode());
+		bvh.wide[index].offset[c] = next;
+		collapseBVHNode(bvh, children[c], next);
 	}
-	return false;
 }
 
-bool isShaded(const Scene &scene, const RenderParams &params, const Ray &ray, const ObjectId &excludeObjectID) {
-	ObjectId a;
-	float d;
-	bool isInside;
-	return _findNearestObject(scene, params, ray, excludeObjectID, true, a, d, isInside);
+static void collapseBVH(BVH &bvh) {
+	bvh.wide.clear();
+	if (bvh.nodes.empty())
+		return;
+	bvh.wide.reserve(bvh.nodes.size() / (BVH_WIDTH - 1) + 1);
+	bvh.wide.push_back(WideBVHNode());
+	collapseBVHNode(bvh, 0, 0);
 }
 
-Color _renderPixel(const Scene &scene, const RenderParams &params, const Ray &ray, ObjectId prevObjectID, int depth, float rIndex) {
-	ObjectId objectID;
-	Vec3 pos, norm;
-	Material *m;
-	bool isInside = false;
-	if (!findNearestObject(scene, params, ray, prevObjectID, false, objectID, pos, norm, &m, isInside)) {
-		return scene.bgColor;
+// Expands triangle i of an indexed mesh, with its face normal
+static Triangle meshTriangle(const Mesh &mesh, int i) {
+	Triangle t;
+	for (int k = 0; k < 3; k++) {
+		unsigned int v = mesh.indices[3 * i + k];
+		t.vertex[k] = mesh.vertices[v];
+		t.texCoord[k] = mesh.texCoords.empty() ? glm::vec2() : mesh.texCoords[v];
 	}
+	t.norm = glm::normalize(glm::cross(t.vertex[1] - t.vertex[0], t.vertex[2] - t.vertex[0]));
+	t.material = mesh.material;
+	return t;
+}
 
-	Color texture = { 1.0, 1.0, 1.0 };
-	if (m->texFunc && objectID.type == TRIANGLE) {
-		const Triangle &obj = scene.triangles[objectID.index];
-		Vec3 f1 = obj.vertex[0] - pos;
-		Vec3 f2 = obj.vertex[1] - pos;
-		Vec3 f3 = obj.vertex[2] - pos;
-		float a = glm::length(glm::cross(obj.vertex[0] - obj.vertex[1], obj.vertex[1] - obj.vertex[2]));
-		float a1 = glm::length(glm::cross(f2, f3)) / a;
-		float a2 = glm::length(glm::cross(f3, f1)) / a;
-		float a3 = glm::length(glm::cross(f1, f2)) / a;
-		texture = m->texFunc(obj.texCoord[0] * a1 + obj.texCoord[1] * a2 + obj.texCoord[2] * a3);
+static BoundingBox meshTriangleBounds(const Mesh &mesh, int i) {
+	BoundingBox b = emptyBox();
+	for (int k = 0; k < 3; k++)
+		b = merge(b, mesh.vertices[mesh.indices[3 * i + k]]);
+	return b;
+}
+
+void fillMeshBatch(Mesh &mesh) {
+	std::vector<int> order(mesh.bvh.objects.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = mesh.bvh.objects[i].index;
+	fillTriangleBatch(mesh.batch, order, [&](int i) { return meshTriangle(mesh, i); });
+	collapseBVH(mesh.bvh);
+}
+
+// Returns the index past the subtree of node i if it is laid out depth-first as buildBVH does it,
+// with every leaf in range of bvh.objects, or -1
+static int checkBVHNode(const BVH &bvh, int i, int depth) {
+	if (i >= bvh.nodes.size() || depth > BVH_MAX_DEPTH)
+		return -1;
+	const BVHNode &node = bvh.nodes[i];
+	if (node.count > 0)
+		return node.offset >= 0 && node.offset <= (int)bvh.objects.size() - node.count ? i + 1 : -1;
+	int right = node.count == 0 ? checkBVHNode(bvh, i + 1, depth + 1) : -1;
+	if (right < 0 || node.offset != right)
+		return -1;
+	return checkBVHNode(bvh, right, depth + 1);
+}
+
+bool checkMesh(const Mesh &mesh) {
+	for (unsigned int v : mesh.indices) {
+		if (v >= mesh.vertices.size())
+			return false;
 	}
-	Color c = scene.bgColor * m->ambientFactor * texture;
-	Vec3 reflectionDir = glm::normalize(glm::reflect(ray.dir, norm));
-	for (const Light &light : scene.lights) {
-		Vec3 lightDir;
-		if (light.type == LT_POINT) {
-			lightDir = glm::normalize(light.position - pos);
-		}
-		else if (light.type == LT_DIRECTIONAL) {
-			lightDir = -light.position;
-		}
-		else if (light.type == LT_SPOT) {
-			lightDir = glm::normalize(light.position - pos);
-			float p = glm::dot(-lightDir, light.spotDir);
-			if (p < light.spotCutoff)
-				continue;
-		}
+	for (const ObjectId &id : mesh.bvh.objects) {
+		if (id.type != TRIANGLE || id.index < 0 || id.index >= mesh.triangleCount())
+			return false;
+	}
+	return mesh.bvh.nodes.empty() ? mesh.bvh.objects.empty() : checkBVHNode(mesh.bvh, 0, 0) == (int)mesh.bvh.nodes.size();
+}
 
-		float s = glm::dot(norm, lightDir);
-		if (s > 0.0f && !isShaded(scene, params, { pos, lightDir }, objectID)) {
-			Color diffuse(s * light.intensity * texture);
-			c += diffuse * light.color * m->diffuseFactor;
+void buildMesh(Mesh &mesh, int threads, BuildStats *stats) {
+	auto start = std::chrono::steady_clock::now();
+	int count = mesh.triangleCount();
+	std::vector<ObjectId> objects(count);
+	std::vector<BoundingBox> bounds(count);
+	getThreadPool(threads).parallelFor(count, threads, BUILD_GRAIN, [&](int begin, int end) {
+		for (int i = begin; i < end; i++) {
+			objects[i] = { TRIANGLE, i };
+			bounds[i] = meshTriangleBounds(mesh, i);
 		}
+	});
+	buildBVH(mesh.bvh, objects, bounds, threads);
+	fillMeshBatch(mesh);
+	if (stats) {
+		stats->buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats->nodes = mesh.bvh.nodes.size();
+		stats->references = mesh.bvh.objects.size();
+	}
+}
 
-		float t = glm::dot(lightDir, reflectionDir);
-		if (t > 0.0f && !isShaded(scene, params, { pos, reflectionDir }, objectID)) {
-			Color specular = Color(powf(t, m->shininess) * light.intensity);
-			c += specular * light.color * m->specularFactor;
-		}
+Instance makeInstance(const Mesh &mesh, const Mat4 &transform, Material *material) {
+	Instance instance = { &mesh, transform, glm::inverse(transform), material };
+	return instance;
+}
+
+// Rebuilt every frame; instances only contribute the transformed root bounds of their mesh's BVH
+void buildBVH(Scene &scene, int threads, BuildStats *stats) {
+	auto start = std::chrono::steady_clock::now();
+	std::vector<ObjectId> objects;
+	std::vector<BoundingBox> bounds;
+	for (int i = 0; i < scene.spheres.size(); i++) {
+		objects.push_back({ SPHERE, i });
+		bounds.push_back(get_bbox(scene.spheres[i]));
 	}
+	for (int i = 0; i < scene.triangles.size(); i++) {
+		objects.push_back({ TRIANGLE, i });
+		bounds.push_back(get_bbox(scene.triangles[i]));
+	}
+	for (int i = 0; i < scene.instances.size(); i++) {
+		if (scene.instances[i].mesh->bvh.nodes.empty())
+			continue;
+		objects.push_back({ INSTANCE, i });
+		bounds.push_back(get_bbox(scene.instances[i]));
+	}
+	buildBVH(scene.bvh, objects, bounds, threads);
+	collapseBVH(scene.bvh);
+	std::vector<int> order(scene.bvh.objects.size());
+	for (int i = 0; i < order.size(); i++)
+		order[i] = scene.bvh.objects[i].type == TRIANGLE ? scene.bvh.objects[i].index : -1;
+	fillTriangleBatch(scene.batch, order, [&](int i) -> const Triangle & { return scene.triangles[i]; });
+	if (stats) {
+		stats->buildTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		stats->nodes = scene.bvh.nodes.size();
+		stats->references = scene.bvh.objects.size();
+	}
+}
 
-	if (depth < params.depthLimit) {
-		c += _renderPixel(scene, params, { pos, reflectionDir }, objectID, depth + 1, rIndex) * m->reflectionFactor;
-		if (m->refract) {
-			float n = rIndex / m->refraction;
-			Vec3 N = norm;
-			if (isInside)
-				N *= -1;
-			float cosI = glm::dot(N, ray.dir);
-			float cosT2 = 1.0f - n * n * (1.0f - cosI * cosI);
-			Color r;
-			if (cosT2 > 0.0f) {
-				Vec3 refractionDir = n * ray.dir + (n * cosI - sqrtf(cosT2)) * N;
-				// For refraction we don't exclude current object
-				r = _renderPixel(scene, params, { pos + refractionDir * 1e-5f, refractionDir }, {}, depth + 1, m->refraction) * m->refractionFactor;
-			}
-			c = c * (1 - m->refractionFactor) + r;
-		}
+void destroyBVH(Scene &scene) {
+	scene.bvh.nodes.clear();
+	scene.bvh.wide.clear();
+	scene.bvh.objects.clear();
+	scene.batch = TriangleBatch();
+}
+
+void buildAccel(Scene &scene, const RenderParams &params, BuildStats *stats) {
+	destroyOctree(scene);
+	destroyBVH(scene);
+	if (stats) {
+		stats->buildTime = 0;
+		stats->nodes = 0;
+		stats->references = 0;
 	}
-	return glm::clamp(c, 0.0f, 1.0f);
+	if (params.accel == ACCEL_OCTREE)
+		buildOctree(scene, params.threads, stats);
+	else if (params.accel == ACCEL_BVH)
+		buildBVH(scene, params.threads, stats);
+}
+
+// Slab test, returning the entry and exit distances along the ray
+static bool intersectBboxRay(const BoundingBox &bbox, const Ray &ray, float &tnear, float &tfar) {
+	Vec3 a = (bbox.min - ray.from) * ray.inv_dir;
+	Vec3 b = (bbox.max - ray.from) * ray.inv_dir;
+
+	tnear = std::max(std::max(std::min(a[0], b[0]), std::min(a[1], b[1])), std::min(a[2], b[2]));
+	tfar = std::min(std::min(std::max(a[0], b[0]), std::max(a[1], b[1])), std::max(a[2], b[2]));
+
+	// if tfar < 0, ray (line) is intersecting AABB, but whole AABB is behind us
+	// if tnear > tfar, ray doesn't intersect AABB
+	return tfar >= 0 && tnear <= tfar;
 }
 
-static void _render(const Scene &scene, unsigned int *pixels, const RenderParams &params, int threadid, const Mat4 &proj, const glm::vec4 &viewport) {
-	Mat4 model;
-	int part = params.height / params.threads;
-	for (int i = 0; i < part; i++) {
-		int y = part * threadid + i;
-		for (int x = 0; x < params.width; x++) {
-			Vec3 win = { x, y, 0 };
-			Vec3 p = glm::unProject(win, model, proj, viewport);
-			Color c = _renderPixel(scene, params, { scene.camera.position, glm::normalize(p - scene.camera.position) }, {}, 0, 1.0f);
-			pixels[y * params.width + x] = ((unsigned int)(255 * c.r) & 0xFF) << 16 | ((unsigned int)(255 * c.g) & 0xFF) << 8 | ((unsigned int)(255 * c.b) & 0xFF);
+static_assert(PACKET_MAX % TRIANGLE_LANES == 0, "a packet must be a whole number of lanes");
+
+// Rays traced together through the octree or a BVH. Origins and inverse directions are also stored
+// as structure of arrays, so one box test covers TRIANGLE_LANES rays; unused lanes hold zeros.
+struct RayPacket {
+	int count;
+	int lanes; // count rounded up to whole lanes
+	int octant; // direction sign bits shared by all rays as in findNode, or -1 if they differ
+	Ray rays[PACKET_MAX];
+	float from[3][PACKET_MAX], invDir[3][PACKET_MAX];
+};
+
+static void makePacket(RayPacket &packet, const Ray *rays, int count) {
+	packet.count = count;
+	packet.lanes = (count + TRIANGLE_LANES - 1) / TRIANGLE_LANES * TRIANGLE_LANES;
+	for (int r = 0; r < packet.lanes; r++) {
+		if (r < count)
+			packet.rays[r] = rays[r];
+		for (int k = 0; k < 3; k++) {
+			packet.from[k][r] = r < count ? rays[r].from[k] : 0.0f;
+			packet.invDir[k][r] = r < count ? rays[r].inv_dir[k] : 0.0f;
 		}
 	}
+	packet.octant = -1;
+	for (int r = 0; r < count; r++) {
+		const Vec3 &d = rays[r].dir;
+		int octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+		if (r > 0 && octant != packet.octant)
+			return;
+		packet.octant = octant;
+	}
 }
 
-void render(const Scene &scene, unsigned int *pixels, const RenderParams &params) {
-	Mat4 proj = glm::perspective(scene.camera.fovy * 3.14159265358979323846f / 180.0f, scene.camera.aspect, scene.camera.zNear, scene.camera.zFar) *
-		glm::lookAt(scene.camera.position, scene.camera.at, scene.camera.up);
-	glm::vec4 viewport(0, 0, params.width, params.height);
-	std::vector<std::future<void>> tasks;
-	for (int i = 0; i < params.threads; i++) {
-		tasks.push_back(std::async(std::launch::async, _render, scene, pixels, params, i, proj, viewport));
+// intersectBboxRay for the rays of a packet: returns the rays among active that hit the box no
+// farther than their limit, and stores every lane's entry distance in tnear
+static int intersectBboxPacket(const BoundingBox &bbox, const RayPacket &packet, const float *limit, int active, float tnear[PACKET_MAX]) {
+	int hits = 0;
+	Lanes zero = broadcast(0.0f);
+	for (int first = 0; first < packet.lanes; first += TRIANGLE_LANES) {
+		if ((active >> first & ((1 << TRIANGLE_LANES) - 1)) == 0)
+			continue;
+		Lanes tmin, tmax;
+		for (int k = 0; k < 3; k++) {
+			Lanes from = loadLanes(packet.from[k] + first), invDir = loadLanes(packet.invDir[k] + first);
+			Lanes a = mul(sub(broadcast(bbox.min[k]), from), invDir);
+			Lanes b = mul(sub(broadcast(bbox.max[k]), from), invDir);
+			tmin = k == 0 ? minLanes(a, b) : maxLanes(tmin, minLanes(a, b));
+			tmax = k == 0 ? maxLanes(a, b) : minLanes(tmax, maxLanes(a, b));
+		}
+		LaneMask hit = both(both(greaterEqual(tmax, zero), lessEqual(tmin, tmax)), notGreater(tmin, loadLanes(limit + first)));
+		storeLanes(tnear + first, tmin);
+		hits |= maskBits(hit) << first;
 	}
-	for (int i = 0; i < tasks.size(); i++) {
-		tasks[i].get();
+	return hits & active;
+}
+
+// Index of the lowest ray in a non-empty mask
+static int firstRay(int rays) {
+	int r = 0;
+	while ((rays >> r & 1) == 0)
+		r++;
+	return r;
+}
+
+static bool intersectRaySphere(const Ray &ray, const Vec3 &center, float radius, float &distance) {
+	float len = glm::dot(ray.dir, center - ray.from);
+	if (len < 0.f) // behind the ray
+		return false;
+	Vec3 d = center - (ray.from + ray.dir * len);
+	float dst2 = glm::dot(d, d);
+	float r2 = radius * radius;
+	if (dst2 > r2) return false;
+	distance = len - sqrt(r2 - dst2);
+	return true;
+}
+
+// Tests the ray against batch slots [first, first + TRIANGLE_LANES). Returns a bit mask of the
+// lanes hit closer than maxDist and stores every lane's distance in t.
+// Follows glm::intersectRayTriangle operation for operation, so hits are bit-identical to it.
+static int intersectTriangleLanes(const TriangleBatch &batch, int first, const Ray &ray, float maxDist, float t[TRIANGLE_LANES]) {
+	Lanes dx = broadcast(ray.dir.x), dy = broadcast(ray.dir.y), dz = broadcast(ray.dir.z);
+	Lanes e1x = loadLanes(&batch.e1[0][first]), e1y = loadLanes(&batch.e1[1][first]), e1z = loadLanes(&batch.e1[2][first]);
+	Lanes e2x = loadLanes(&batch.e2[0][first]), e2y = loadLanes(&batch.e2[1][first]), e2z = loadLanes(&batch.e2[2][first]);
+	Lanes zero = broadcast(0.0f), one = broadcast(1.0f);
+
+	// p = cross(dir, e2), a = dot(e1, p)
+	Lanes px = sub(mul(dy, e2z), mul(e2y, dz));
+	Lanes py = sub(mul(dz, e2x), mul(e2z, dx));
+	Lanes pz = sub(mul(dx, e2y), mul(e2x, dy));
+	Lanes a = add(add(mul(e1x, px), mul(e1y, py)), mul(e1z, pz));
+	LaneMask hit = notLess(a, broadcast(std::numeric_limits<float>::epsilon()));
+	Lanes f = div(one, a);
+
+	// s = from - v0, u = f * dot(s, p)
+	Lanes sx = sub(broadcast(ray.from.x), loadLanes(&batch.v0[0][first]));
+	Lanes sy = sub(broadcast(ray.from.y), loadLanes(&batch.v0[1][first]));
+	Lanes sz = sub(broadcast(ray.from.z), loadLanes(&batch.v0[2][first]));
+	Lanes u = mul(f, add(add(mul(sx, px), mul(sy, py)), mul(sz, pz)));
+	hit = both(hit, both(notLess(u, zero), notGreater(u, one)));
+
+	// q = cross(s, e1), v = f * dot(dir, q), distance = f * dot(e2, q)
+	Lanes qx = sub(mul(sy, e1z), mul(e1y, sz));
+	Lanes qy = sub(mul(sz, e1x), mul(e1z, sx));
+	Lanes qz = sub(mul(sx, e1y), mul(e1x, sy));
+	Lanes v = mul(f, add(add(mul(dx, qx), mul(dy, qy)), mul(dz, qz)));
+	hit = both(hit, both(notLess(v, zero), notGreater(add(v, u), one)));
+	Lanes d = mul(f, add(add(mul(e2x, qx), mul(e2y, qy)), mul(e2z, qz)));
+	hit = both(hit, both(greaterEqual(d, zero), less(d, broadcast(maxDist))));
+
+	storeLanes(t, d);
+	return maskBits(hit);
+}
+
+// Closest hit among batch slots [begin, end) for which accept(slot) holds. Lowers nearestDist and
+// returns the slot hit, or -1. Ties go to the earlier slot, as in a sequential loop.
+template <typename Accept>
+static int closestTriangle(const TriangleBatch &batch, int begin, int end, const Ray &ray, float &nearestDist, Accept accept) {
+	int nearest = -1;
+	for (int first = begin; first < end; first += TRIANGLE_LANES) {
+		int valid = 0;
+		for (int l = 0; l < TRIANGLE_LANES && first + l < end; l++) {
+			if (accept(first + l))
+				valid |= 1 << l;
+		}
+		if (valid == 0)
+			continue;
+		float t[TRIANGLE_LANES];
+		int hits = intersectTriangleLanes(batch, first, ray, nearestDist, t) & valid;
+		for (int l = 0; hits != 0; l++, hits >>= 1) {
+			if ((hits & 1) && t[l] < nearestDist) {
+				nearestDist = t[l];
+				nearest = first + l;
+			}
+		}
+	}
+	return nearest;
+}
+
+// An accepted slot in [begin, end) hit closer than maxDist, or -1 if there is none
+template <typename Accept>
+static int anyTriangle(const TriangleBatch &batch, int begin, int end, const Ray &ray, float maxDist, Accept accept) {
+	for (int first = begin; first < end; first += TRIANGLE_LANES) {
+		int valid = 0;
+		for (int l = 0; l < TRIANGLE_LANES && first + l < end; l++) {
+			if (accept(first + l))
+				valid |= 1 << l;
+		}
+		float t[TRIANGLE_LANES];
+		int hits = valid != 0 ? intersectTriangleLanes(batch, first, ray, maxDist, t) & valid : 0;
+		if (hits != 0) {
+			int l = 0;
+			while ((hits >> l & 1) == 0)
+				l++;
+			return first + l;
+		}
+	}
+	return -1;
+}
+
+// A primitive that blocked a shadow ray. Triangles found in a batch keep their batch and slot, so testing
+// them again gives exactly the answer of the traversal that found them.
+struct Occluder {
+	ObjectId id; // type INVALID when there is none
+	const TriangleBatch *batch;
+	int slot;
+};
+
+static void setOccluder(Occluder *occluder, const ObjectId &id, const TriangleBatch *batch, int slot) {
+	if (occluder) {
+		occluder->id = id;
+		occluder->batch = batch;
+		occluder->slot = slot;
+	}
+}
+
+enum ShadeState {
+	SHADE_TRACE, // the ray is still to be traced
+	SHADE_REFLECT, // the hit is shaded, the reflection ray comes next
+	SHADE_REFRACT, // the reflection color is known, the refraction ray comes next
+	SHADE_COMBINE // the refraction color is known
+};
+
+// A ray on the explicit stack of _renderPixel, with what its hit needs to combine the colors of its bounces
+struct ShadeFrame {
+	Ray ray;
+	ObjectId exclude;
+	int depth;
+	float rIndex;
+	float weight; // share of the ray's color in the pixel, ignoring clamping
+	ShadeState state;
+	ObjectId objectID;
+	Vec3 pos, norm, reflectionDir;
+	Material *m;
+	bool isInside;
+	Color local, reflection;
+};
+
+// An occlusion query already answered at the current shading point
+struct VisibilityQuery {
+	Vec3 dir;
+	float maxDist;
+	bool occluded;
+};
+
+// Per-worker scratch state for tracing; each render thread owns one, so nothing is shared
+struct TraceContext {
+	// Mailbox: stamps[i] == ray when object i was already tested against the current octree ray; spheres
+	// are numbered after the triangles, and instances after the spheres. For a packet, testedRays[i] then holds the rays of the packet that tested it.
+	// ray keeps counting from frame to frame, so stamps left by earlier frames never match and need no clearing.
+	std::vector<unsigned> stamps;
+	std::vector<unsigned> testedRays; // only with packets
+	unsigned ray;
+	long long objectTests;
+	long long skippedObjectTests;
+	long long secondaryRays, prunedRays;
+	long long shadowRays, sharedShadowRays;
+	long long occluderTests, occluderHits;
+	std::vector<Occluder> occluders; // last occluder of the shadow rays toward each light, then of specular rays
+	std::vector<unsigned char> lit; // renderPacket: whether each light reaches each primary hit
+	std::vector<VisibilityQuery> visibility; // shadeLocal: queries from the hit being shaded
+	std::vector<ShadeFrame> shadeStack;
+};
+
+static void nextMailboxRay(TraceContext &ctx) {
+	if (++ctx.ray == 0) {
+		std::fill(ctx.stamps.begin(), ctx.stamps.end(), 0);
+		ctx.ray = 1;
+	}
+}
+
+// Objects straddling cells are stored in several leaves; returns false if this ray already tested object i
+static bool mailboxTest(TraceContext &ctx, int i) {
+	if (ctx.stamps[i] == ctx.ray) {
+		ctx.skippedObjectTests++;
+		return false;
+	}
+	ctx.stamps[i] = ctx.ray;
+	ctx.objectTests++;
+	return true;
+}
+
+// mailboxTest for ray r of the current packet
+static bool packetMailboxTest(TraceContext &ctx, int i, int r) {
+	if (ctx.stamps[i] != ctx.ray) {
+		ctx.stamps[i] = ctx.ray;
+		ctx.testedRays[i] = 0;
+	}
+	else if (ctx.testedRays[i] >> r & 1) {
+		ctx.skippedObjectTests++;
+		return false;
+	}
+	ctx.testedRays[i] |= 1u << r;
+	ctx.objectTests++;
+	return true;
+}
+
+// The active rays of the packet that pass packetMailboxTest for object i
+static int packetMailboxRays(TraceContext &ctx, int i, const RayPacket &packet, int active) {
+	int rays = 0;
+	for (int r = 0; r < packet.count; r++) {
+		if ((active >> r & 1) && packetMailboxTest(ctx, i, r))
+			rays |= 1 << r;
+	}
+	return rays;
+}
+
+// Closest sphere i among objects [begin, end) for which accept(i) holds; lowers nearestDist and returns
+// the sphere hit, or -1
+template <typename Accept>
+static int closestSphere(const Scene &scene, const std::vector<ObjectId> &objects, int begin, int end, const Ray &ray, float &nearestDist, Accept accept) {
+	int nearest = -1;
+	for (int k = begin; k < end; k++) {
+		int i = objects[k].index;
+		const Sphere &obj = scene.spheres[i];
+		float distance;
+		if (accept(i) && intersectRaySphere(ray, obj.center, obj.radius, distance) && distance < nearestDist) {
+			nearestDist = distance;
+			nearest = i;
+		}
+	}
+	return nearest;
+}
+
+// An accepted sphere hit closer than maxDist, or -1 if there is none
+template <typename Accept>
+static int anySphere(const Scene &scene, const std::vector<ObjectId> &objects, int begin, int end, const Ray &ray, float maxDist, Accept accept) {
+	for (int k = begin; k < end; k++) {
+		int i = objects[k].index;
+		const Sphere &obj = scene.spheres[i];
+		float distance;
+		if (accept(i) && intersectRaySphere(ray, obj.center, obj.radius, distance) && distance < maxDist)
+			return i;
+	}
+	return -1;
+}
+
+static bool intersectTriangle(const Triangle &obj, const Ray &ray, float &distance) {
+	Vec3 baryPos;
+	if (!glm::intersectRayTriangle(ray.from, ray.dir, obj.vertex[0], obj.vertex[1], obj.vertex[2], baryPos))
+		return false;
+	// See https://github.com/g-truc/glm/issues/6
+	distance = baryPos.z;
+	return true;
+}
+
+static bool sameObject(const ObjectId &a, const ObjectId &b) {
+	return a.type == b.type && a.index == b.index && (a.type != INSTANCE || a.prim == b.prim);
+}
+
+static_assert(BVH_WIDTH % TRIANGLE_LANES == 0, "a wide BVH node must be a whole number of lanes");
+
+// intersectBboxRay for all children of a wide node at once: returns the children entered no farther
+// than limit and stores every slot's entry distance in tnear
+static int intersectWideNode(const WideBVHNode &node, const Ray &ray, float limit, float tnear[BVH_WIDTH]) {
+	int hits = 0;
+	Lanes zero = broadcast(0.0f);
+	for (int first = 0; first < node.children; first += TRIANGLE_LANES) {
+		Lanes tmin, tmax;
+		for (int k = 0; k < 3; k++) {
+			Lanes from = broadcast(ray.from[k]), invDir = broadcast(ray.inv_dir[k]);
+			Lanes a = mul(sub(loadLanes(node.min[k] + first), from), invDir);
+			Lanes b = mul(sub(loadLanes(node.max[k] + first), from), invDir);
+			tmin = k == 0 ? minLanes(a, b) : maxLanes(tmin, minLanes(a, b));
+			tmax = k == 0 ? maxLanes(a, b) : minLanes(tmax, maxLanes(a, b));
+		}
+		LaneMask hit = both(both(greaterEqual(tmax, zero), lessEqual(tmin, tmax)), lessEqual(tmin, broadcast(limit)));
+		storeLanes(tnear + first, tmin);
+		hits |= maskBits(hit) << first;
+	}
+	return hits & ((1 << node.children) - 1);
+}
+
+static BoundingBox wideChildBounds(const WideBVHNode &node, int c) {
+	BoundingBox b = { { node.min[0][c], node.min[1][c], node.min[2][c] }, { node.max[0][c], node.max[1][c], node.max[2][c] } };
+	return b;
+}
+
+// Stores the slots set in hits in order, nearest first by key, and returns how many there are.
+// Equal keys keep slot order.
+static int sortHits(int hits, const float key[BVH_WIDTH], int order[BVH_WIDTH]) {
+	int n = 0;
+	for (int c = 0; hits != 0; c++, hits >>= 1) {
+		if ((hits & 1) == 0)
+			continue;
+		int i = n++;
+		for (; i > 0 && key[order[i - 1]] > key[c]; i--)
+			order[i] = order[i - 1];
+		order[i] = c;
+	}
+	return n;
+}
+
+// An inner node pushes at most BVH_WIDTH entries and the wide tree is no deeper than the binary one
+const int BVH_STACK = (BVH_MAX_DEPTH + 2) * BVH_WIDTH;
+
+// Closest-hit traversal: visit(begin, end) is called for the BVH::objects range of each leaf
+// near to far and may lower nearestDist, which prunes the subtrees that start behind it
+template <typename Visit>
+static void traverseBVH(const BVH &bvh, const Ray &ray, const float &nearestDist, Visit visit) {
+	if (bvh.wide.empty())
+		return;
+
+	// Entries are wide nodes, or leaves when count > 0
+	struct { int offset, count; float tnear; } stack[BVH_STACK];
+	int sp = 0;
+	stack[sp++] = { 0, 0, -std::numeric_limits<float>::infinity() };
+	while (sp > 0) {
+		sp--;
+		// Skip subtrees that start behind the closest hit found so far
+		if (stack[sp].tnear > nearestDist)
+			continue;
+		int offset = stack[sp].offset, count = stack[sp].count;
+		if (count > 0) {
+			visit(offset, offset + count);
+			continue;
+		}
+		const WideBVHNode &node = bvh.wide[offset];
+		float tnear[BVH_WIDTH];
+		int order[BVH_WIDTH];
+		int n = sortHits(intersectWideNode(node, ray, nearestDist, tnear), tnear, order);
+		// Push the farthest child first so the nearest one is visited first
+		for (int i = n - 1; i >= 0; i--) {
+			int c = order[i];
+			stack[sp++] = { node.offset[c], node.count[c], tnear[c] };
+		}
+	}
+}
+
+// Any-hit traversal: stops as soon as visit(begin, end) returns true for a leaf
+template <typename Visit>
+static bool anyHitBVH(const BVH &bvh, const Ray &ray, float maxDist, Visit visit) {
+	if (bvh.wide.empty())
+		return false;
+
+	struct { int offset, count; } stack[BVH_STACK];
+	int sp = 0;
+	stack[sp++] = { 0, 0 };
+	while (sp > 0) {
+		sp--;
+		int offset = stack[sp].offset, count = stack[sp].count;
+		if (count > 0) {
+			if (visit(offset, offset + count))
+				return true;
+			continue;
+		}
+		const WideBVHNode &node = bvh.wide[offset];
+		float tnear[BVH_WIDTH];
+		int hits = intersectWideNode(node, ray, maxDist, tnear);
+		for (int c = node.children - 1; c >= 0; c--) {
+			if (hits >> c & 1)
+				stack[sp++] = { node.offset[c], node.count[c] };
+		}
+	}
+	return false;
+}
+
+// traverseBVH for the active rays of a packet sharing one stack: visit(begin, end, rays) is called for each
+// leaf with the rays whose boxes reached it. Children are ordered by the entry distance of the first ray that
+// hits each, so the other rays may meet leaves in a different order than alone, which only matters for
+// exactly tied hits.
+template <typename Visit>
+static void traverseBVHPacket(const BVH &bvh, const RayPacket &packet, int active, const float *nearestDist, Visit visit) {
+	if (bvh.wide.empty() || active == 0)
+		return;
+
+	struct { int offset, count, rays; } stack[BVH_STACK];
+	int sp = 0;
+	stack[sp++] = { 0, 0, active };
+	while (sp > 0) {
+		sp--;
+		int offset = stack[sp].offset, count = stack[sp].count, rays = stack[sp].rays;
+		if (count > 0) {
+			visit(offset, offset + count, rays);
+			continue;
+		}
+		const WideBVHNode &node = bvh.wide[offset];
+		int hit[BVH_WIDTH], hits = 0;
+		float key[BVH_WIDTH];
+		for (int c = 0; c < node.children; c++) {
+			float tnear[PACKET_MAX];
+			hit[c] = intersectBboxPacket(wideChildBounds(node, c), packet, nearestDist, rays, tnear);
+			if (hit[c] != 0) {
+				hits |= 1 << c;
+				key[c] = tnear[firstRay(hit[c])];
+			}
+		}
+		int order[BVH_WIDTH];
+		int n = sortHits(hits, key, order);
+		// Push the farthest child first so the nearest one is visited first
+		for (int i = n - 1; i >= 0; i--) {
+			int c = order[i];
+			stack[sp++] = { node.offset[c], node.count[c], hit[c] };
+		}
+	}
+}
+
+// anyHitBVH for the active rays of a packet: visit(begin, end, rays) returns the rays a leaf occludes,
+// which then leave the traversal. Returns the occluded rays.
+template <typename Visit>
+static int anyHitBVHPacket(const BVH &bvh, const RayPacket &packet, int active, const float *maxDist, Visit visit) {
+	if (bvh.wide.empty() || active == 0)
+		return 0;
+
+	struct { int offset, count, rays; } stack[BVH_STACK];
+	int sp = 0;
+	stack[sp++] = { 0, 0, active };
+	int occluded = 0;
+	while (sp > 0 && occluded != active) {
+		sp--;
+		int offset = stack[sp].offset, count = stack[sp].count, rays = stack[sp].rays & ~occluded;
+		if (rays == 0)
+			continue;
+		if (count > 0) {
+			occluded |= visit(offset, offset + count, rays);
+			continue;
+		}
+		const WideBVHNode &node = bvh.wide[offset];
+		for (int c = node.children - 1; c >= 0; c--) {
+			float tnear[PACKET_MAX];
+			int hit = intersectBboxPacket(wideChildBounds(node, c), packet, maxDist, rays, tnear);
+			if (hit != 0)
+				stack[sp++] = { node.offset[c], node.count[c], hit };
+		}
+	}
+	return occluded;
+}
+
+static bool intersectMeshTriangle(const Mesh &mesh, int i, const Ray &ray, float &distance) {
+	const unsigned int *v = &mesh.indices[3 * i];
+	Vec3 baryPos;
+	if (!glm::intersectRayTriangle(ray.from, ray.dir, mesh.vertices[v[0]], mesh.vertices[v[1]], mesh.vertices[v[2]], baryPos))
+		return false;
+	distance = baryPos.z;
+	return true;
+}
+
+// Closest accepted triangle among the batch slots of one mesh BVH leaf, which are in BVH object order
+static bool findMeshLeaf(const Mesh &mesh, const Material *material, int begin, int end, const Ray &ray, int excludeId, bool excludeTransparentMat, int &nearestId, float &nearestDist) {
+	int slot = closestTriangle(mesh.batch, begin, end, ray, nearestDist, [&](int slot) {
+		int i = mesh.batch.index[slot];
+		return i != excludeId && !(excludeTransparentMat && (material ? material->refract : mesh.batch.transparent[slot]));
+	});
+	if (slot < 0)
+		return false;
+	nearestId = mesh.batch.index[slot];
+	return true;
+}
+
+// The occluder is left for occludedInstance to tag with its instance
+static bool occludedMeshLeaf(const Mesh &mesh, const Material *material, int begin, int end, const Ray &ray, int excludeId, float maxDist, Occluder *occluder = nullptr) {
+	int slot = anyTriangle(mesh.batch, begin, end, ray, maxDist, [&](int slot) {
+		int i = mesh.batch.index[slot];
+		return i != excludeId && !(material ? material->refract : mesh.batch.transparent[slot]);
+	});
+	if (slot >= 0)
+		setOccluder(occluder, { INSTANCE, -1, mesh.batch.index[slot] }, &mesh.batch, slot);
+	return slot >= 0;
+}
+
+// Meshes are traced through their own BVH unless acceleration is disabled altogether
+static bool findMesh(const Mesh &mesh, const Material *material, const RenderParams &params, const Ray &ray, int excludeId, bool excludeTransparentMat, int &nearestId, float &nearestDist) {
+	bool found = false;
+	if (params.accel == ACCEL_NONE) {
+		if (excludeTransparentMat && (material ? material : mesh.material)->refract)
+			return false;
+		for (int i = 0; i < mesh.triangleCount(); i++) {
+			float distance;
+			if (i != excludeId && intersectMeshTriangle(mesh, i, ray, distance) && distance < nearestDist) {
+				found = true;
+				nearestDist = distance;
+				nearestId = i;
+			}
+		}
+		return found;
+	}
+
+	traverseBVH(mesh.bvh, ray, nearestDist, [&](int begin, int end) {
+		if (findMeshLeaf(mesh, material, begin, end, ray, excludeId, excludeTransparentMat, nearestId, nearestDist))
+			found = true;
+	});
+	return found;
+}
+
+static bool occludedMesh(const Mesh &mesh, const Material *material, const RenderParams &params, const Ray &ray, int excludeId, float maxDist, Occluder *occluder) {
+	if (params.accel == ACCEL_NONE) {
+		if ((material ? material : mesh.material)->refract)
+			return false;
+		for (int i = 0; i < mesh.triangleCount(); i++) {
+			float distance;
+			if (i != excludeId && intersectMeshTriangle(mesh, i, ray, distance) && distance < maxDist) {
+				setOccluder(occluder, { INSTANCE, -1, i }, nullptr, 0);
+				return true;
+			}
+		}
+		return false;
+	}
+	return anyHitBVH(mesh.bvh, ray, maxDist, [&](int begin, int end) {
+		return occludedMeshLeaf(mesh, material, begin, end, ray, excludeId, maxDist, occluder);
+	});
+}
+
+// Packets are only traced with an acceleration structure, so meshes always use their BVH
+static int findMeshPacket(const Mesh &mesh, const Material *material, const RayPacket &packet, int active, const int *excludeId, bool excludeTransparentMat, int *nearestId, float *nearestDist) {
+	int found = 0;
+	traverseBVHPacket(mesh.bvh, packet, active, nearestDist, [&](int begin, int end, int rays) {
+		for (int r = 0; r < packet.count; r++) {
+			if ((rays >> r & 1) && findMeshLeaf(mesh, material, begin, end, packet.rays[r], excludeId[r], excludeTransparentMat, nearestId[r], nearestDist[r]))
+				found |= 1 << r;
+		}
+	});
+	return found;
+}
+
+static int occludedMeshPacket(const Mesh &mesh, const Material *material, const RayPacket &packet, int active, const int *excludeId, const float *maxDist, Occluder *occluder) {
+	return anyHitBVHPacket(mesh.bvh, packet, active, maxDist, [&](int begin, int end, int rays) {
+		int occluded = 0;
+		for (int r = 0; r < packet.count; r++) {
+			if ((rays >> r & 1) && occludedMeshLeaf(mesh, material, begin, end, packet.rays[r], excludeId[r], maxDist[r], occluder))
+				occluded |= 1 << r;
+		}
+		return occluded;
+	});
+}
+
+// The direction is not renormalized, so distances along the object space ray equal world space distances
+static Ray toObjectSpace(const Instance &instance, const Ray &ray) {
+	return Ray(Vec3(instance.invTransform * glm::vec4(ray.from, 1.0f)), Vec3(instance.invTransform * glm::vec4(ray.dir, 0.0f)));
+}
+
+static RayPacket toObjectSpace(const Instance &instance, const RayPacket &packet, int active) {
+	Ray rays[PACKET_MAX];
+	for (int r = 0; r < packet.count; r++)
+		rays[r] = (active >> r & 1) ? toObjectSpace(instance, packet.rays[r]) : packet.rays[r];
+	RayPacket local;
+	makePacket(local, rays, packet.count);
+	return local;
+}
+
+// Triangle of instance index to skip, or -1
+static int instanceExcludeId(const ObjectId &excludeObjectID, int index) {
+	return excludeObjectID.type == INSTANCE && excludeObjectID.index == index ? excludeObjectID.prim : -1;
+}
+
+static bool findInstance(const Scene &scene, const RenderParams &params, int index, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	const Instance &instance = scene.instances[index];
+	int prim;
+	if (!findMesh(*instance.mesh, instance.material, params, toObjectSpace(instance, ray), instanceExcludeId(excludeObjectID, index), excludeTransparentMat, prim, nearestDist))
+		return false;
+	nearestObjectID.type = INSTANCE;
+	nearestObjectID.index = index;
+	nearestObjectID.prim = prim;
+	isInside = false;
+	return true;
+}
+
+static bool occludedInstance(const Scene &scene, const RenderParams &params, int index, const Ray &ray, const ObjectId &excludeObjectID, float maxDist, Occluder *occluder) {
+	const Instance &instance = scene.instances[index];
+	if (!occludedMesh(*instance.mesh, instance.material, params, toObjectSpace(instance, ray), instanceExcludeId(excludeObjectID, index), maxDist, occluder))
+		return false;
+	if (occluder)
+		occluder->id.index = index;
+	return true;
+}
+
+static int findInstancePacket(const Scene &scene, int index, const RayPacket &packet, int active, const ObjectId *excludeObjectID, bool excludeTransparentMat, ObjectId *nearestObjectID, float *nearestDist, bool *isInside) {
+	const Instance &instance = scene.instances[index];
+	int excludeId[PACKET_MAX], prim[PACKET_MAX];
+	for (int r = 0; r < packet.count; r++)
+		excludeId[r] = instanceExcludeId(excludeObjectID[r], index);
+	int found = findMeshPacket(*instance.mesh, instance.material, toObjectSpace(instance, packet, active), active, excludeId, excludeTransparentMat, prim, nearestDist);
+	for (int r = 0; r < packet.count; r++) {
+		if (found >> r & 1) {
+			nearestObjectID[r].type = INSTANCE;
+			nearestObjectID[r].index = index;
+			nearestObjectID[r].prim = prim[r];
+			isInside[r] = false;
+		}
+	}
+	return found;
+}
+
+static int occludedInstancePacket(const Scene &scene, int index, const RayPacket &packet, int active, const ObjectId *excludeObjectID, const float *maxDist, Occluder *occluder) {
+	const Instance &instance = scene.instances[index];
+	int excludeId[PACKET_MAX];
+	for (int r = 0; r < packet.count; r++)
+		excludeId[r] = instanceExcludeId(excludeObjectID[r], index);
+	int occluded = occludedMeshPacket(*instance.mesh, instance.material, toObjectSpace(instance, packet, active), active, excludeId, maxDist, occluder);
+	if (occluded != 0 && occluder)
+		occluder->id.index = index;
+	return occluded;
+}
+
+// Mailbox index of instance i, numbered after the triangles and spheres
+static int instanceMailbox(const Scene &scene, int i) {
+	return scene.triangles.size() + scene.spheres.size() + i;
+}
+
+// Leaves hold triangles, spheres and instances; the mailbox numbers spheres after the triangles
+static bool findNode(const Scene &scene, const RenderParams &params, TraceContext &ctx, int index, const Ray &ray, const ObjectId &exclude, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	const Octree &tree = scene.octree;
+	const OctreeNode &node = tree.nodes[index];
+	bool found = false;
+	if (node.count == 0) {
+		// Flipping the octant bits of negative direction components visits children front to back
+		int mask = (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 4 : 0);
+		for (int j = 0; j < 8; j++) {
+			int child = node.subnodes[j ^ mask];
+			// Early pruning! Also skip children entered behind the nearest hit so far
+			float tnear, tfar;
+			if (child < 0 || !intersectBboxRay(tree.nodes[child].bounds, ray, tnear, tfar) || tnear > nearestDist)
+				continue;
+
+			if (findNode(scene, params, ctx, child, ray, exclude, excludeTransparentMat, nearestObjectID, nearestDist, isInside))
+				found = true;
+		}
+	}
+	else {
+		const TriangleBatch &batch = tree.batch;
+		int slot = closestTriangle(batch, node.offset, node.offset + node.triangles, ray, nearestDist, [&](int slot) {
+			int i = batch.index[slot];
+			return !(exclude.type == TRIANGLE && i == exclude.index) && mailboxTest(ctx, i);
+		});
+		if (slot >= 0) {
+			found = true;
+			nearestObjectID = { TRIANGLE, batch.index[slot] };
+			isInside = false;
+		}
+		int spheres = node.offset + node.triangles, instances = spheres + node.spheres;
+		int sphere = closestSphere(scene, tree.objects, spheres, instances, ray, nearestDist, [&](int i) {
+			return !(exclude.type == SPHERE && i == exclude.index) && !(excludeTransparentMat && scene.spheres[i].material->refract) &&
+				mailboxTest(ctx, scene.triangles.size() + i);
+		});
+		if (sphere >= 0) {
+			found = true;
+			nearestObjectID = { SPHERE, sphere };
+			isInside = glm::distance(ray.from, scene.spheres[sphere].center) < scene.spheres[sphere].radius;
+		}
+		for (int k = instances; k < node.offset + node.count; k++) {
+			int i = tree.objects[k].index;
+			if (mailboxTest(ctx, instanceMailbox(scene, i)) &&
+				findInstance(scene, params, i, ray, exclude, excludeTransparentMat, nearestObjectID, nearestDist, isInside))
+				found = true;
+		}
+	}
+	return found;
+}
+
+// Any-hit query for shadow rays: returns as soon as something closer than maxDist is found
+static bool occludedNode(const Scene &scene, const RenderParams &params, TraceContext &ctx, int index, const Ray &ray, const ObjectId &exclude, float maxDist, Occluder *occluder) {
+	const Octree &tree = scene.octree;
+	const OctreeNode &node = tree.nodes[index];
+	if (node.count == 0) {
+		int mask = (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 4 : 0);
+		for (int j = 0; j < 8; j++) {
+			int child = node.subnodes[j ^ mask];
+			float tnear, tfar;
+			if (child < 0 || !intersectBboxRay(tree.nodes[child].bounds, ray, tnear, tfar) || tnear > maxDist)
+				continue;
+
+			if (occludedNode(scene, params, ctx, child, ray, exclude, maxDist, occluder))
+				return true;
+		}
+	}
+	else {
+		int spheres = node.offset + node.triangles, instances = spheres + node.spheres;
+		int sphere = anySphere(scene, tree.objects, spheres, instances, ray, maxDist, [&](int i) {
+			return !(exclude.type == SPHERE && i == exclude.index) && !scene.spheres[i].material->refract && mailboxTest(ctx, scene.triangles.size() + i);
+		});
+		if (sphere >= 0) {
+			setOccluder(occluder, { SPHERE, sphere }, nullptr, 0);
+			return true;
+		}
+		const TriangleBatch &batch = tree.batch;
+		int slot = anyTriangle(batch, node.offset, node.offset + node.triangles, ray, maxDist, [&](int slot) {
+			int i = batch.index[slot];
+			return !(exclude.type == TRIANGLE && i == exclude.index) && !batch.transparent[slot] && mailboxTest(ctx, i);
+		});
+		if (slot >= 0) {
+			setOccluder(occluder, { TRIANGLE, batch.index[slot] }, &batch, slot);
+			return true;
+		}
+		// Instances last, as each one is a traversal of its own
+		for (int k = instances; k < node.offset + node.count; k++) {
+			int i = tree.objects[k].index;
+			if (mailboxTest(ctx, instanceMailbox(scene, i)) && occludedInstance(scene, params, i, ray, exclude, maxDist, occluder))
+				return true;
+		}
+	}
+	return false;
+}
+
+// findNode for the active rays of a packet sharing one octant, so all of them visit children in the same
+// order as when traced alone. Returns the rays that found a closer hit.
+static int findNodePacket(const Scene &scene, TraceContext &ctx, int index, const RayPacket &packet, int active, const ObjectId *exclude, bool excludeTransparentMat, ObjectId *nearestObjectID, float *nearestDist, bool *isInside) {
+	const Octree &tree = scene.octree;
+	const OctreeNode &node = tree.nodes[index];
+	int found = 0;
+	if (node.count == 0) {
+		for (int j = 0; j < 8; j++) {
+			int child = node.subnodes[j ^ packet.octant];
+			if (child < 0)
+				continue;
+			float tnear[PACKET_MAX];
+			int rays = intersectBboxPacket(tree.nodes[child].bounds, packet, nearestDist, active, tnear);
+			if (rays != 0)
+				found |= findNodePacket(scene, ctx, child, packet, rays, exclude, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+		}
+	}
+	else {
+		const TriangleBatch &batch = tree.batch;
+		int spheres = node.offset + node.triangles, instances = spheres + node.spheres;
+		for (int r = 0; r < packet.count; r++) {
+			if ((active >> r & 1) == 0)
+				continue;
+			const Ray &ray = packet.rays[r];
+			int slot = closestTriangle(batch, node.offset, node.offset + node.triangles, ray, nearestDist[r], [&](int slot) {
+				int i = batch.index[slot];
+				return !(exclude[r].type == TRIANGLE && i == exclude[r].index) && packetMailboxTest(ctx, i, r);
+			});
+			if (slot >= 0) {
+				found |= 1 << r;
+				nearestObjectID[r] = { TRIANGLE, batch.index[slot] };
+				isInside[r] = false;
+			}
+			int sphere = closestSphere(scene, tree.objects, spheres, instances, ray, nearestDist[r], [&](int i) {
+				return !(exclude[r].type == SPHERE && i == exclude[r].index) && !(excludeTransparentMat && scene.spheres[i].material->refract) &&
+					packetMailboxTest(ctx, scene.triangles.size() + i, r);
+			});
+			if (sphere >= 0) {
+				found |= 1 << r;
+				nearestObjectID[r] = { SPHERE, sphere };
+				isInside[r] = glm::distance(ray.from, scene.spheres[sphere].center) < scene.spheres[sphere].radius;
+			}
+		}
+		// Each instance is traversed once by the rays of the packet that have not tested it yet
+		for (int k = instances; k < node.offset + node.count; k++) {
+			int i = tree.objects[k].index;
+			int rays = packetMailboxRays(ctx, instanceMailbox(scene, i), packet, active);
+			if (rays != 0)
+				found |= findInstancePacket(scene, i, packet, rays, exclude, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+		}
+	}
+	return found;
+}
+
+// occludedNode for the active rays of a packet; returns the rays that are occluded
+static int occludedNodePacket(const Scene &scene, TraceContext &ctx, int index, const RayPacket &packet, int active, const ObjectId *exclude, const float *maxDist, Occluder *occluder) {
+	const Octree &tree = scene.octree;
+	const OctreeNode &node = tree.nodes[index];
+	int occluded = 0;
+	if (node.count == 0) {
+		for (int j = 0; j < 8 && occluded != active; j++) {
+			int child = node.subnodes[j ^ packet.octant];
+			if (child < 0)
+				continue;
+			float tnear[PACKET_MAX];
+			int rays = intersectBboxPacket(tree.nodes[child].bounds, packet, maxDist, active & ~occluded, tnear);
+			if (rays != 0)
+				occluded |= occludedNodePacket(scene, ctx, child, packet, rays, exclude, maxDist, occluder);
+		}
+	}
+	else {
+		const TriangleBatch &batch = tree.batch;
+		int spheres = node.offset + node.triangles, instances = spheres + node.spheres;
+		for (int r = 0; r < packet.count; r++) {
+			if ((active >> r & 1) == 0)
+				continue;
+			int sphere = anySphere(scene, tree.objects, spheres, instances, packet.rays[r], maxDist[r], [&](int i) {
+				return !(exclude[r].type == SPHERE && i == exclude[r].index) && !scene.spheres[i].material->refract &&
+					packetMailboxTest(ctx, scene.triangles.size() + i, r);
+			});
+			if (sphere >= 0) {
+				setOccluder(occluder, { SPHERE, sphere }, nullptr, 0);
+				occluded |= 1 << r;
+				continue;
+			}
+			int slot = anyTriangle(batch, node.offset, node.offset + node.triangles, packet.rays[r], maxDist[r], [&](int slot) {
+				int i = batch.index[slot];
+				return !(exclude[r].type == TRIANGLE && i == exclude[r].index) && !batch.transparent[slot] && packetMailboxTest(ctx, i, r);
+			});
+			if (slot >= 0) {
+				setOccluder(occluder, { TRIANGLE, batch.index[slot] }, &batch, slot);
+				occluded |= 1 << r;
+			}
+		}
+		for (int k = instances; k < node.offset + node.count && occluded != active; k++) {
+			int i = tree.objects[k].index;
+			int rays = packetMailboxRays(ctx, instanceMailbox(scene, i), packet, active & ~occluded);
+			if (rays != 0)
+				occluded |= occludedInstancePacket(scene, i, packet, rays, exclude, maxDist, occluder);
+		}
+	}
+	return occluded;
+}
+
+static bool intersectObject(const Scene &scene, const ObjectId &id, const Ray &ray, bool excludeTransparentMat, float &distance, bool &isInside) {
+	if (id.type == SPHERE) {
+		const Sphere &obj = scene.spheres[id.index];
+		if (excludeTransparentMat && obj.material->refract)
+			return false;
+		if (!intersectRaySphere(ray, obj.center, obj.radius, distance))
+			return false;
+		isInside = glm::distance(ray.from, obj.center) < obj.radius;
+		return true;
+	}
+	else {
+		const Triangle &obj = scene.triangles[id.index];
+		if (excludeTransparentMat && obj.material->refract)
+			return false;
+		isInside = false;
+		return intersectTriangle(obj, ray, distance);
+	}
+}
+
+// Closest accepted scene triangle among the batch slots of one top-level BVH leaf.
+// Triangles are tested from the batch; only the winner's Triangle is read, by the caller.
+static bool findBatchTriangles(const Scene &scene, int begin, int end, const Ray &ray, const ObjectId &excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	int slot = closestTriangle(scene.batch, begin, end, ray, nearestDist, [&](int slot) {
+		int i = scene.batch.index[slot];
+		return i >= 0 && !(excludeObjectID.type == TRIANGLE && i == excludeObjectID.index) && !(excludeTransparentMat && scene.batch.transparent[slot]);
+	});
+	if (slot < 0)
+		return false;
+	nearestObjectID = scene.bvh.objects[slot];
+	isInside = false;
+	return true;
+}
+
+static bool occludedBatchTriangles(const Scene &scene, int begin, int end, const Ray &ray, const ObjectId &excludeObjectID, float maxDist, Occluder *occluder = nullptr) {
+	int slot = anyTriangle(scene.batch, begin, end, ray, maxDist, [&](int slot) {
+		int i = scene.batch.index[slot];
+		return i >= 0 && !(excludeObjectID.type == TRIANGLE && i == excludeObjectID.index) && !scene.batch.transparent[slot];
+	});
+	if (slot >= 0)
+		setOccluder(occluder, scene.bvh.objects[slot], &scene.batch, slot);
+	return slot >= 0;
+}
+
+// Tests a sphere or scene triangle, keeping it if it is the closest hit so far
+static bool findObject(const Scene &scene, const ObjectId &id, const Ray &ray, const ObjectId &excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	if (sameObject(id, excludeObjectID))
+		return false;
+	float distance;
+	bool inside;
+	if (intersectObject(scene, id, ray, excludeTransparentMat, distance, inside) && distance < nearestDist) {
+		nearestDist = distance;
+		nearestObjectID = id;
+		isInside = inside;
+		return true;
+	}
+	return false;
+}
+
+static bool occludedObject(const Scene &scene, const ObjectId &id, const Ray &ray, const ObjectId &excludeObjectID, float maxDist, Occluder *occluder = nullptr) {
+	if (sameObject(id, excludeObjectID))
+		return false;
+	float distance;
+	bool inside;
+	if (!intersectObject(scene, id, ray, true, distance, inside) || distance >= maxDist)
+		return false;
+	setOccluder(occluder, id, nullptr, 0);
+	return true;
+}
+
+static bool findBVH(const Scene &scene, const RenderParams &params, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	bool found = false;
+	traverseBVH(scene.bvh, ray, nearestDist, [&](int begin, int end) {
+		if (findBatchTriangles(scene, begin, end, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside))
+			found = true;
+		for (int i = begin; i < end; i++) {
+			const ObjectId &id = scene.bvh.objects[i];
+			if (id.type == TRIANGLE)
+				continue;
+			if (id.type == INSTANCE ? findInstance(scene, params, id.index, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside) :
+				findObject(scene, id, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside))
+				found = true;
+		}
+	});
+	return found;
+}
+
+static bool occludedBVH(const Scene &scene, const RenderParams &params, const Ray &ray, const ObjectId excludeObjectID, float maxDist, Occluder *occluder) {
+	return anyHitBVH(scene.bvh, ray, maxDist, [&](int begin, int end) {
+		if (occludedBatchTriangles(scene, begin, end, ray, excludeObjectID, maxDist, occluder))
+			return true;
+		for (int i = begin; i < end; i++) {
+			const ObjectId &id = scene.bvh.objects[i];
+			if (id.type == TRIANGLE)
+				continue;
+			if (id.type == INSTANCE ? occludedInstance(scene, params, id.index, ray, excludeObjectID, maxDist, occluder) : occludedObject(scene, id, ray, excludeObjectID, maxDist, occluder))
+				return true;
+		}
+		return false;
+	});
+}
+
+// findBVH for a packet; each ray tests the objects of a leaf in the same order as alone
+static int findBVHPacket(const Scene &scene, const RayPacket &packet, int active, const ObjectId *excludeObjectID, bool excludeTransparentMat, ObjectId *nearestObjectID, float *nearestDist, bool *isInside) {
+	int found = 0;
+	traverseBVHPacket(scene.bvh, packet, active, nearestDist, [&](int begin, int end, int rays) {
+		for (int r = 0; r < packet.count; r++) {
+			if ((rays >> r & 1) && findBatchTriangles(scene, begin, end, packet.rays[r], excludeObjectID[r], excludeTransparentMat, nearestObjectID[r], nearestDist[r], isInside[r]))
+				found |= 1 << r;
+		}
+		for (int i = begin; i < end; i++) {
+			const ObjectId &id = scene.bvh.objects[i];
+			if (id.type == TRIANGLE)
+				continue;
+			if (id.type == INSTANCE) {
+				found |= findInstancePacket(scene, id.index, packet, rays, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+				continue;
+			}
+			for (int r = 0; r < packet.count; r++) {
+				if ((rays >> r & 1) && findObject(scene, id, packet.rays[r], excludeObjectID[r], excludeTransparentMat, nearestObjectID[r], nearestDist[r], isInside[r]))
+					found |= 1 << r;
+			}
+		}
+	});
+	return found;
+}
+
+static int occludedBVHPacket(const Scene &scene, const RayPacket &packet, int active, const ObjectId *excludeObjectID, const float *maxDist, Occluder *occluder) {
+	return anyHitBVHPacket(scene.bvh, packet, active, maxDist, [&](int begin, int end, int rays) {
+		int occluded = 0;
+		for (int r = 0; r < packet.count; r++) {
+			if ((rays >> r & 1) && occludedBatchTriangles(scene, begin, end, packet.rays[r], excludeObjectID[r], maxDist[r], occluder))
+				occluded |= 1 << r;
+		}
+		for (int i = begin; i < end && occluded != rays; i++) {
+			const ObjectId &id = scene.bvh.objects[i];
+			if (id.type == TRIANGLE)
+				continue;
+			if (id.type == INSTANCE) {
+				occluded |= occludedInstancePacket(scene, id.index, packet, rays & ~occluded, excludeObjectID, maxDist, occluder);
+				continue;
+			}
+			for (int r = 0; r < packet.count; r++) {
+				if (((rays & ~occluded) >> r & 1) && occludedObject(scene, id, packet.rays[r], excludeObjectID[r], maxDist[r], occluder))
+					occluded |= 1 << r;
+			}
+		}
+		return occluded;
+	});
+}
+
+static bool findSpheres(const Scene &scene, const Ray &ray, const ObjectId &excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	bool found = false;
+	for (int i = 0; i < scene.spheres.size(); i++) {
+		if (excludeObjectID.type == SPHERE && i == excludeObjectID.index)
+			continue;
+		const Sphere &obj = scene.spheres[i];
+		if (excludeTransparentMat && obj.material->refract)
+			continue;
+		float distance;
+		if (intersectRaySphere(ray, obj.center, obj.radius, distance)) {
+			if (distance < nearestDist) {
+				found = true;
+				nearestDist = distance;
+				nearestObjectID.type = SPHERE;
+				nearestObjectID.index = i;
+				isInside = glm::distance(ray.from, obj.center) < obj.radius;
+			}
+		}
+	}
+	return found;
+}
+
+static bool occludedSpheres(const Scene &scene, const Ray &ray, const ObjectId &excludeObjectID, float maxDist, Occluder *occluder = nullptr) {
+	for (int i = 0; i < scene.spheres.size(); i++) {
+		if (excludeObjectID.type == SPHERE && i == excludeObjectID.index)
+			continue;
+		float distance;
+		bool inside;
+		if (intersectObject(scene, { SPHERE, i }, ray, true, distance, inside) && distance < maxDist) {
+			setOccluder(occluder, { SPHERE, i }, nullptr, 0);
+			return true;
+		}
+	}
+	return false;
+}
+
+static bool _findNearestObject(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, float &nearestDist, bool &isInside) {
+	if (params.accel == ACCEL_BVH)
+		return findBVH(scene, params, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+
+	if (params.accel == ACCEL_OCTREE) {
+		nextMailboxRay(ctx);
+		return findNode(scene, params, ctx, 0, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+	}
+
+	bool found = findSpheres(scene, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+	for (int i = 0; i < scene.triangles.size(); i++) {
+		if (excludeObjectID.type == TRIANGLE && i == excludeObjectID.index)
+			continue;
+		const Triangle &obj = scene.triangles[i];
+		if (excludeTransparentMat && obj.material->refract)
+			continue;
+		float distance;
+		if (intersectTriangle(obj, ray, distance)) {
+			if (distance < nearestDist) {
+				found = true;
+				nearestDist = distance;
+				nearestObjectID.type = TRIANGLE;
+				nearestObjectID.index = i;
+				isInside = false;
+			}
+		}
+	}
+	for (int i = 0; i < scene.instances.size(); i++) {
+		if (findInstance(scene, params, i, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside))
+			found = true;
+	}
+	return found;
+}
+
+// _findNearestObject for a packet of rays sharing one octant, with an acceleration structure.
+// Returns the rays that hit something.
+static int findNearestPacket(const Scene &scene, const RenderParams &params, TraceContext &ctx, const RayPacket &packet, const ObjectId *excludeObjectID, bool excludeTransparentMat, ObjectId *nearestObjectID, float *nearestDist, bool *isInside) {
+	int active = (1 << packet.count) - 1;
+	if (params.accel == ACCEL_BVH)
+		return findBVHPacket(scene, packet, active, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+
+	nextMailboxRay(ctx);
+	return findNodePacket(scene, ctx, 0, packet, active, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside);
+}
+
+static Triangle getTriangle(const Scene &scene, const ObjectId &id) {
+	if (id.type == INSTANCE)
+		return meshTriangle(*scene.instances[id.index].mesh, id.prim);
+	return scene.triangles[id.index];
+}
+
+// Position, normal and material of a hit nearestDist along the ray
+static void hitSurface(const Scene &scene, const Ray &ray, const ObjectId &nearestObjectID, float nearestDist, Vec3 &nearestPos, Vec3 &nearestNorm, Material **nearestMat, bool &isInside) {
+	if (nearestObjectID.type == SPHERE) {
+		const Sphere &obj = scene.spheres[nearestObjectID.index];
+		nearestPos = ray.from + ray.dir * nearestDist;
+		nearestNorm = (nearestPos - obj.center) / obj.radius;
+		*nearestMat = obj.material;
+	}
+	else if (nearestObjectID.type == INSTANCE) {
+		const Instance &instance = scene.instances[nearestObjectID.index];
+		Triangle obj = meshTriangle(*instance.mesh, nearestObjectID.prim);
+		nearestPos = ray.from + ray.dir * nearestDist;
+		nearestNorm = glm::normalize(glm::transpose(glm::mat3(instance.invTransform)) * obj.norm);
+		*nearestMat = instance.material ? instance.material : obj.material;
+		isInside = false;
+	}
+	else {
+		const Triangle &obj = scene.triangles[nearestObjectID.index];
+		nearestPos = ray.from + ray.dir * nearestDist;
+		nearestNorm = obj.norm;
+		*nearestMat = obj.material;
+		isInside = false;
+	}
+}
+
+static bool findNearestObject(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray &ray, const ObjectId excludeObjectID, bool excludeTransparentMat, ObjectId &nearestObjectID, Vec3 &nearestPos, Vec3 &nearestNorm, Material **nearestMat, bool &isInside) {
+	float nearestDist = std::numeric_limits<float>::max();
+	if (_findNearestObject(scene, params, ctx, ray, excludeObjectID, excludeTransparentMat, nearestObjectID, nearestDist, isInside)) {
+		hitSurface(scene, ray, nearestObjectID, nearestDist, nearestPos, nearestNorm, nearestMat, isInside);
+		return true;
+	}
+	return false;
+}
+
+// Transparent objects don't cast shadows
+// Sets occluder, if given, to what blocked the ray
+static bool isShaded(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray &ray, const ObjectId &excludeObjectID, float maxDist, Occluder *occluder = nullptr) {
+	if (params.accel == ACCEL_BVH)
+		return occludedBVH(scene, params, ray, excludeObjectID, maxDist, occluder);
+
+	if (params.accel == ACCEL_OCTREE) {
+		nextMailboxRay(ctx);
+		return occludedNode(scene, params, ctx, 0, ray, excludeObjectID, maxDist, occluder);
+	}
+
+	if (occludedSpheres(scene, ray, excludeObjectID, maxDist, occluder))
+		return true;
+	for (int i = 0; i < scene.instances.size(); i++) {
+		if (occludedInstance(scene, params, i, ray, excludeObjectID, maxDist, occluder))
+			return true;
+	}
+
+	for (int i = 0; i < scene.triangles.size(); i++) {
+		if (excludeObjectID.type == TRIANGLE && i == excludeObjectID.index)
+			continue;
+		float distance;
+		bool inside;
+		if (intersectObject(scene, { TRIANGLE, i }, ray, true, distance, inside) && distance < maxDist) {
+			setOccluder(occluder, { TRIANGLE, i }, nullptr, 0);
+			return true;
+		}
+	}
+	return false;
+}
+
+// Whether the primitive that last blocked a shadow ray of the given kind on this thread blocks ray too.
+// Neighboring shading points are mostly shadowed by the same primitive, which then saves a traversal.
+static bool lastOccluderBlocks(const Scene &scene, TraceContext &ctx, int kind, const Ray &ray, const ObjectId &excludeObjectID, float maxDist) {
+	const Occluder &last = ctx.occluders[kind];
+	const ObjectId &id = last.id;
+	if (id.type == INVALID || sameObject(id, excludeObjectID))
+		return false;
+	ctx.occluderTests++;
+	bool blocks;
+	if (last.batch) {
+		Ray r = id.type == INSTANCE ? toObjectSpace(scene.instances[id.index], ray) : ray;
+		int first = last.slot - last.slot % TRIANGLE_LANES;
+		float t[TRIANGLE_LANES];
+		blocks = (intersectTriangleLanes(*last.batch, first, r, maxDist, t) >> (last.slot - first) & 1) != 0;
+	}
+	else if (id.type == INSTANCE) {
+		float distance;
+		blocks = intersectMeshTriangle(*scene.instances[id.index].mesh, id.prim, toObjectSpace(scene.instances[id.index], ray), distance) && distance < maxDist;
+	}
+	else {
+		blocks = occludedObject(scene, id, ray, excludeObjectID, maxDist);
+	}
+	if (blocks)
+		ctx.occluderHits++;
+	return blocks;
+}
+
+// isShaded for a shadow ray of the given kind, trying its last occluder first
+static bool isShadedCached(const Scene &scene, const RenderParams &params, TraceContext &ctx, int kind, const Ray &ray, const ObjectId &excludeObjectID, float maxDist) {
+	if (lastOccluderBlocks(scene, ctx, kind, ray, excludeObjectID, maxDist))
+		return true;
+	ctx.shadowRays++;
+	return isShaded(scene, params, ctx, ray, excludeObjectID, maxDist, &ctx.occluders[kind]);
+}
+
+// isShaded for a packet of rays sharing one octant, with an acceleration structure. Returns the shaded rays.
+// Sets occluder, if given, to what blocked one of the occluded rays
+static int shadedPacket(const Scene &scene, const RenderParams &params, TraceContext &ctx, const RayPacket &packet, const ObjectId *excludeObjectID, const float *maxDist, Occluder *occluder) {
+	int active = (1 << packet.count) - 1;
+	if (params.accel == ACCEL_BVH)
+		return occludedBVHPacket(scene, packet, active, excludeObjectID, maxDist, occluder);
+
+	nextMailboxRay(ctx);
+	return occludedNodePacket(scene, ctx, 0, packet, active, excludeObjectID, maxDist, occluder);
+}
+
+// Direction from pos toward a light and the distance beyond which occluders don't shadow it.
+// Returns false if pos is outside a spot light's cone.
+static bool lightDirection(const Light &light, const Vec3 &pos, Vec3 &lightDir, float &lightDist) {
+	lightDist = std::numeric_limits<float>::infinity();
+	if (light.type == LT_POINT) {
+		lightDir = glm::normalize(light.position - pos);
+		lightDist = glm::distance(light.position, pos);
+	}
+	else if (light.type == LT_DIRECTIONAL) {
+		lightDir = -light.position;
+	}
+	else if (light.type == LT_SPOT) {
+		lightDir = glm::normalize(light.position - pos);
+		lightDist = glm::distance(light.position, pos);
+		float p = glm::dot(-lightDir, light.spotDir);
+		if (p < light.spotCutoff)
+			return false;
+	}
+	return true;
+}
+
+// isShadedCached for a ray from the hit being shaded, traced only if the same query wasn't already made there.
+// Each light asks about the specular ray along reflectionDir, so it is traced once instead of once a light.
+static bool occludedFromHit(const Scene &scene, const RenderParams &params, TraceContext &ctx, int kind, const Vec3 &pos, const Vec3 &dir, const ObjectId &objectID, float maxDist) {
+	for (const VisibilityQuery &q : ctx.visibility) {
+		if (q.dir == dir && q.maxDist == maxDist) {
+			ctx.sharedShadowRays++;
+			return q.occluded;
+		}
+	}
+	VisibilityQuery q = { dir, maxDist, isShadedCached(scene, params, ctx, kind, { pos, dir }, objectID, maxDist) };
+	ctx.visibility.push_back(q);
+	return q.occluded;
+}
+
+// Ambient, diffuse and specular light at a hit, before reflection and refraction are added. lit[l] tells
+// whether light l reaches pos, when the shadow rays toward the lights were traced as packets beforehand;
+// without it they are traced here.
+static Color shadeLocal(const Scene &scene, const RenderParams &params, TraceContext &ctx, const ObjectId &objectID, const Vec3 &pos, const Vec3 &norm, const Vec3 &reflectionDir, const Material *m, const unsigned char *lit) {
+	Color texture = { 1.0, 1.0, 1.0 };
+	if (m->texFunc && objectID.type != SPHERE) {
+		Triangle obj = getTriangle(scene, objectID);
+		// Instanced triangles are stored in object space
+		Vec3 p = objectID.type == INSTANCE ? Vec3(scene.instances[objectID.index].invTransform * glm::vec4(pos, 1.0f)) : pos;
+		Vec3 f1 = obj.vertex[0] - p;
+		Vec3 f2 = obj.vertex[1] - p;
+		Vec3 f3 = obj.vertex[2] - p;
+		float a = glm::length(glm::cross(obj.vertex[0] - obj.vertex[1], obj.vertex[1] - obj.vertex[2]));
+		float a1 = glm::length(glm::cross(f2, f3)) / a;
+		float a2 = glm::length(glm::cross(f3, f1)) / a;
+		float a3 = glm::length(glm::cross(f1, f2)) / a;
+		texture = m->texFunc(obj.texCoord[0] * a1 + obj.texCoord[1] * a2 + obj.texCoord[2] * a3);
+	}
+	Color c = scene.bgColor * m->ambientFactor * texture;
+	ctx.visibility.clear();
+	for (int l = 0; l < scene.lights.size(); l++) {
+		const Light &light = scene.lights[l];
+		Vec3 lightDir;
+		float lightDist;
+		if (!lightDirection(light, pos, lightDir, lightDist))
+			continue;
+
+		float s = glm::dot(norm, lightDir);
+		if (s > 0.0f && (lit ? lit[l] != 0 : !occludedFromHit(scene, params, ctx, l, pos, lightDir, objectID, lightDist))) {
+			Color diffuse(s * light.intensity * texture);
+			c += diffuse * light.color * m->diffuseFactor;
+		}
+
+		float t = glm::dot(lightDir, reflectionDir);
+		if (t > 0.0f && !occludedFromHit(scene, params, ctx, scene.lights.size(), pos, reflectionDir, objectID, std::numeric_limits<float>::infinity())) {
+			Color specular = Color(powf(t, m->shininess) * light.intensity);
+			c += specular * light.color * m->specularFactor;
+		}
+	}
+	return c;
+}
+
+// Continuation of a ray refracted at pos, starting just past the surface. Returns false on total internal reflection.
+static bool refractRay(const Ray &ray, const Vec3 &pos, const Vec3 &norm, bool isInside, float rIndex, const Material *m, Ray &refracted) {
+	float n = rIndex / m->refraction;
+	Vec3 N = norm;
+	if (isInside)
+		N *= -1;
+	float cosI = glm::dot(N, ray.dir);
+	float cosT2 = 1.0f - n * n * (1.0f - cosI * cosI);
+	if (cosT2 > 0.0f) {
+		Vec3 refractionDir = n * ray.dir + (n * cosI - sqrtf(cosT2)) * N;
+		refracted = Ray(pos + refractionDir * 1e-5f, refractionDir);
+		return true;
+	}
+	return false;
+}
+
+// Adds the colors seen along the reflected and refracted rays to the local color of a hit.
+// refraction is null when the material doesn't refract or the ray was totally reflected.
+static Color addBounces(Color c, const Material *m, const Color &reflection, const Color *refraction) {
+	c += reflection * m->reflectionFactor;
+	if (m->refract) {
+		Color r;
+		if (refraction)
+			r = *refraction * m->refractionFactor;
+		c = c * (1 - m->refractionFactor) + r;
+	}
+	return c;
+}
+
+// Path weights of the reflection and refraction rays of a hit on m, from the weight of the ray that hit it
+static float reflectionWeight(float weight, const Material *m) {
+	return weight * m->reflectionFactor * (m->refract ? 1 - m->refractionFactor : 1.0f);
+}
+
+static float refractionWeight(float weight, const Material *m) {
+	return weight * m->refractionFactor;
+}
+
+// Whether a reflection or refraction ray carries enough of the pixel to be traced. A ray with no weight
+// can't change the pixel, so skipping it is exact; above that, the pixel changes by less than the weight.
+static bool traceBounce(const RenderParams &params, TraceContext &ctx, float weight) {
+	if (weight > params.minRayWeight) {
+		ctx.secondaryRays++;
+		return true;
+	}
+	ctx.prunedRays++;
+	return false;
+}
+
+static ShadeFrame shadeFrame(const Ray &ray, const ObjectId &exclude, int depth, float rIndex, float weight) {
+	ShadeFrame f;
+	f.ray = ray;
+	f.exclude = exclude;
+	f.depth = depth;
+	f.rIndex = rIndex;
+	f.weight = weight;
+	f.state = SHADE_TRACE;
+	f.isInside = false;
+	return f;
+}
+
+static void shadeFrameHit(const Scene &scene, const RenderParams &params, TraceContext &ctx, ShadeFrame &f, const unsigned char *lit) {
+	f.reflectionDir = glm::normalize(glm::reflect(f.ray.dir, f.norm));
+	f.local = shadeLocal(scene, params, ctx, f.objectID, f.pos, f.norm, f.reflectionDir, f.m, lit);
+	f.state = SHADE_REFLECT;
+}
+
+// Evaluates the ray trees of the frames above base on ctx.shadeStack depth-first, without recursion. A hit
+// pushes its reflection ray, then its refraction ray once the reflection color is known, and combines both
+// with its local color when it is on top again, clamping at every level as a recursive shader would.
+static Color resolveShadeStack(const Scene &scene, const RenderParams &params, TraceContext &ctx, size_t base) {
+	std::vector<ShadeFrame> &stack = ctx.shadeStack;
+	Color result;
+	while (stack.size() > base) {
+		// Pushing may move the frames, so f is not used after a push
+		ShadeFrame &f = stack.back();
+		if (f.state == SHADE_TRACE) {
+			if (!findNearestObject(scene, params, ctx, f.ray, f.exclude, false, f.objectID, f.pos, f.norm, &f.m, f.isInside)) {
+				result = scene.bgColor;
+				stack.pop_back();
+				continue;
+			}
+			shadeFrameHit(scene, params, ctx, f, nullptr);
+		}
+		if (f.state == SHADE_REFLECT) {
+			if (f.depth >= params.depthLimit) {
+				result = glm::clamp(f.local, 0.0f, 1.0f);
+				stack.pop_back();
+				continue;
+			}
+			f.state = SHADE_REFRACT;
+			float weight = reflectionWeight(f.weight, f.m);
+			if (traceBounce(params, ctx, weight)) {
+				stack.push_back(shadeFrame({ f.pos, f.reflectionDir }, f.objectID, f.depth + 1, f.rIndex, weight));
+				continue;
+			}
+			result = Color(0, 0, 0);
+		}
+		if (f.state == SHADE_REFRACT) {
+			f.reflection = result;
+			Ray refracted;
+			float weight = refractionWeight(f.weight, f.m);
+			if (f.m->refract && refractRay(f.ray, f.pos, f.norm, f.isInside, f.rIndex, f.m, refracted) && traceBounce(params, ctx, weight)) {
+				f.state = SHADE_COMBINE;
+				// For refraction we don't exclude current object
+				stack.push_back(shadeFrame(refracted, {}, f.depth + 1, f.m->refraction, weight));
+				continue;
+			}
+			result = glm::clamp(addBounces(f.local, f.m, f.reflection, nullptr), 0.0f, 1.0f);
+		}
+		else {
+			result = glm::clamp(addBounces(f.local, f.m, f.reflection, &result), 0.0f, 1.0f);
+		}
+		stack.pop_back();
+	}
+	return result;
+}
+
+// Color of a ray whose closest hit is already known
+static Color shadeHit(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray &ray, const ObjectId &objectID, const Vec3 &pos, const Vec3 &norm, Material *m, bool isInside, int depth, float rIndex, const unsigned char *lit) {
+	size_t base = ctx.shadeStack.size();
+	ShadeFrame f = shadeFrame(ray, {}, depth, rIndex, 1.0f);
+	f.objectID = objectID;
+	f.pos = pos;
+	f.norm = norm;
+	f.m = m;
+	f.isInside = isInside;
+	shadeFrameHit(scene, params, ctx, f, lit);
+	ctx.shadeStack.push_back(f);
+	return resolveShadeStack(scene, params, ctx, base);
+}
+
+Color _renderPixel(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray &ray, ObjectId prevObjectID, int depth, float rIndex) {
+	size_t base = ctx.shadeStack.size();
+	ctx.shadeStack.push_back(shadeFrame(ray, prevObjectID, depth, rIndex, 1.0f));
+	return resolveShadeStack(scene, params, ctx, base);
+}
+
+// Image-plane basis derived once per frame from the camera. The unnormalized direction of the primary ray
+// through window position (x, y) is dir00 + x * dx + y * dy, which points at the same near-plane point as
+// glm::unProject without inverting the view-projection matrix for every pixel.
+struct CameraRays {
+	Vec3 origin;
+	Vec3 dir00, dx, dy;
+};
+
+static CameraRays makeCameraRays(const Camera &camera, int width, int height) {
+	Vec3 forward = glm::normalize(camera.at - camera.position);
+	Vec3 right = glm::normalize(glm::cross(forward, camera.up));
+	Vec3 up = glm::cross(right, forward);
+	float tanY = tanf(camera.fovy * 3.14159265358979323846f / 360.0f);
+	float tanX = tanY * camera.aspect;
+	CameraRays rays = { camera.position, forward - right * tanX - up * tanY, right * (2.0f * tanX / width), up * (2.0f * tanY / height) };
+	return rays;
+}
+
+static_assert(TILE_SIZE % TRIANGLE_LANES == 0, "a tile row must be a whole number of lanes");
+
+// Normalized directions of the primary rays through the window positions (px[i], py[i]) of one tile row
+static void cameraRayRow(const CameraRays &camera, const float px[TILE_SIZE], const float py[TILE_SIZE], float dir[3][TILE_SIZE]) {
+	for (int i = 0; i < TILE_SIZE; i += TRIANGLE_LANES) {
+		Lanes x = loadLanes(px + i), y = loadLanes(py + i);
+		Lanes d[3];
+		for (int k = 0; k < 3; k++)
+			d[k] = add(add(broadcast(camera.dir00[k]), mul(x, broadcast(camera.dx[k]))), mul(y, broadcast(camera.dy[k])));
+		Lanes invLength = div(broadcast(1.0f), sqrtLanes(add(add(mul(d[0], d[0]), mul(d[1], d[1])), mul(d[2], d[2]))));
+		for (int k = 0; k < 3; k++)
+			storeLanes(dir[k] + i, mul(d[k], invLength));
+	}
+}
+
+// Sub-pixel offset in [0, 1) for one axis of sample s of a pixel. It only depends on its arguments,
+// so jittered images don't change with the thread count or tile order.
+static float jitter(unsigned x, unsigned y, unsigned s, unsigned axis) {
+	unsigned h = x * 0x8da6b343u ^ y * 0xd8163841u ^ s * 0xcb1ab31fu ^ axis * 0x165667b1u;
+	h ^= h >> 16;
+	h *= 0x7feb352du;
+	h ^= h >> 15;
+	h *= 0x846ca68bu;
+	h ^= h >> 16;
+	return (h >> 8) * (1.0f / 16777216.0f);
+}
+
+// Per-frame state shared read-only by all tiles of one render() call
+struct FrameContext {
+	const Scene &scene;
+	const RenderParams &params;
+	unsigned int *pixels;
+	CameraRays camera;
+};
+
+// Closest hits of up to PACKET_MAX rays
+struct PacketHits {
+	int found; // rays that hit something
+	ObjectId objectID[PACKET_MAX];
+	Vec3 pos[PACKET_MAX], norm[PACKET_MAX];
+	Material *m[PACKET_MAX];
+	bool isInside[PACKET_MAX];
+};
+
+// Traces the rays as a packet if they share an octant, otherwise one by one
+static void findHits(const Scene &scene, const RenderParams &params, TraceContext &ctx, const Ray *rays, const ObjectId *exclude, int count, PacketHits &hits) {
+	float nearestDist[PACKET_MAX];
+	for (int r = 0; r < PACKET_MAX; r++) {
+		nearestDist[r] = std::numeric_limits<float>::max();
+		hits.isInside[r] = false;
+	}
+	RayPacket packet;
+	makePacket(packet, rays, count);
+	hits.found = 0;
+	if (count > 1 && packet.octant >= 0) {
+		hits.found = findNearestPacket(scene, params, ctx, packet, exclude, false, hits.objectID, nearestDist, hits.isInside);
+	}
+	else {
+		for (int r = 0; r < count; r++) {
+			if (_findNearestObject(scene, params, ctx, rays[r], exclude[r], false, hits.objectID[r], nearestDist[r], hits.isInside[r]))
+				hits.found |= 1 << r;
+		}
+	}
+	for (int r = 0; r < count; r++) {
+		if (hits.found >> r & 1)
+			hitSurface(scene, rays[r], hits.objectID[r], nearestDist[r], hits.pos[r], hits.norm[r], &hits.m[r], hits.isInside[r]);
+	}
+}
+
+// Traces the shadow rays from the hits toward each light as packets, leaving in ctx.lit[r * lights + l]
+// whether light l reaches hit r. Only hits facing a light are asked about it, as in shadeLocal.
+static void traceLights(const Scene &scene, const RenderParams &params, TraceContext &ctx, int count, const PacketHits &hits) {
+	int lights = scene.lights.size();
+	ctx.lit.assign(count * lights, 0);
+	for (int l = 0; l < lights; l++) {
+		Ray shadowRays[PACKET_MAX];
+		ObjectId shadowExclude[PACKET_MAX];
+		float maxDist[PACKET_MAX];
+		int which[PACKET_MAX], n = 0;
+		for (int r = 0; r < count; r++) {
+			Vec3 lightDir;
+			float lightDist;
+			// Rays blocked by the light's last occluder stay unlit without joining the packet
+			if ((hits.found >> r & 1) && lightDirection(scene.lights[l], hits.pos[r], lightDir, lightDist) && glm::dot(hits.norm[r], lightDir) > 0.0f &&
+				!lastOccluderBlocks(scene, ctx, l, Ray(hits.pos[r], lightDir), hits.objectID[r], lightDist)) {
+				shadowRays[n] = Ray(hits.pos[r], lightDir);
+				shadowExclude[n] = hits.objectID[r];
+				maxDist[n] = lightDist;
+				which[n++] = r;
+			}
+		}
+		if (n == 0)
+			continue;
+		ctx.shadowRays += n;
+		RayPacket shadows;
+		makePacket(shadows, shadowRays, n);
+		for (int i = n; i < shadows.lanes; i++)
+			maxDist[i] = 0.0f;
+		int shaded = 0;
+		if (n > 1 && shadows.octant >= 0) {
+			shaded = shadedPacket(scene, params, ctx, shadows, shadowExclude, maxDist, &ctx.occluders[l]);
+		}
+		else {
+			for (int i = 0; i < n; i++) {
+				if (isShaded(scene, params, ctx, shadowRays[i], shadowExclude[i], maxDist[i], &ctx.occluders[l]))
+					shaded |= 1 << i;
+			}
+		}
+		for (int i = 0; i < n; i++)
+			ctx.lit[which[i] * lights + l] = (shaded >> i & 1) ? 0 : 1;
+	}
+}
+
+// Traces count primary rays as a packet, and the shadow rays from their hits toward each light as packets,
+// then shades each hit on its own
+static void renderPacket(const FrameContext &frame, TraceContext &ctx, const Ray *rays, int count, Color *colors) {
+	const Scene &scene = frame.scene;
+	const RenderParams &params = frame.params;
+	ObjectId exclude[PACKET_MAX] = {};
+	PacketHits hits;
+	findHits(scene, params, ctx, rays, exclude, count, hits);
+	traceLights(scene, params, ctx, count, hits);
+	int lights = scene.lights.size();
+	for (int r = 0; r < count; r++) {
+		colors[r] = (hits.found >> r & 1) ? shadeHit(scene, params, ctx, rays[r], hits.objectID[r], hits.pos[r], hits.norm[r], hits.m[r], hits.isInside[r], 0, 1.0f, lights > 0 ? &ctx.lit[r * lights] : nullptr) : scene.bgColor;
+	}
+}
+
+static unsigned int packColor(const Color &c) {
+	return ((unsigned int)(255 * c.r) & 0xFF) << 16 | ((unsigned int)(255 * c.g) & 0xFF) << 8 | ((unsigned int)(255 * c.b) & 0xFF);
+}
+
+static void _render(const FrameContext &frame, TraceContext &ctx, int x0, int y0, int x1, int y1) {
+	const Scene &scene = frame.scene;
+	const RenderParams &params = frame.params;
+	int samples = std::max(params.samples, 1);
+	int packetSize = params.accel != ACCEL_NONE ? std::min(params.packetSize, PACKET_MAX) : 1;
+	float px[TILE_SIZE], py[TILE_SIZE], dir[3][TILE_SIZE];
+	for (int y = y0; y < y1; y++) {
+		Color sum[TILE_SIZE];
+		for (int s = 0; s < samples; s++) {
+			// Columns past x1 are generated to fill the lanes but never traced
+			for (int i = 0; i < TILE_SIZE; i++) {
+				px[i] = (float)(x0 + i);
+				py[i] = (float)y;
+				if (samples > 1) {
+					px[i] += jitter(x0 + i, y, s, 0);
+					py[i] += jitter(x0 + i, y, s, 1);
+				}
+			}
+			cameraRayRow(frame.camera, px, py, dir);
+			Ray rays[TILE_SIZE];
+			Color c[TILE_SIZE];
+			for (int i = 0; i < x1 - x0; i++)
+				rays[i] = Ray(frame.camera.origin, Vec3(dir[0][i], dir[1][i], dir[2][i]));
+			for (int i = 0; i < x1 - x0; i += std::max(packetSize, 1)) {
+				if (packetSize > 1)
+					renderPacket(frame, ctx, rays + i, std::min(packetSize, x1 - x0 - i), c + i);
+				else
+					c[i] = _renderPixel(scene, params, ctx, rays[i], {}, 0, 1.0f);
+			}
+			for (int i = 0; i < x1 - x0; i++)
+				sum[i] = s == 0 ? c[i] : sum[i] + c[i];
+		}
+		for (int x = x0; x < x1; x++)
+			frame.pixels[y * params.width + x] = packColor(sum[x - x0] / (float)samples);
+	}
+}
+
+// One ray of a wavefront level. Tracing stores its hit and the local shading of the hit in color; resolving
+// then replaces color with what _renderPixel would have returned for the ray.
+struct WaveRay {
+	Ray ray;
+	ObjectId exclude;
+	float rIndex;
+	float weight; // as in ShadeFrame
+	ObjectId objectID;
+	Vec3 pos, norm;
+	Material *m; // null on a miss
+	bool isInside;
+	Color color;
+	int reflection, refraction; // rays spawned in the next level, or -1
+};
+
+static WaveRay waveRay(const Ray &ray, const ObjectId &exclude, float rIndex, float weight) {
+	WaveRay w;
+	w.ray = ray;
+	w.exclude = exclude;
+	w.rIndex = rIndex;
+	w.weight = weight;
+	w.m = nullptr;
+	w.reflection = w.refraction = -1;
+	return w;
+}
+
+// Cell of x among cells equal parts of [0, 1); values outside and NaNs go to the nearest end
+static unsigned quantize(float x, unsigned cells) {
+	if (!(x > 0.0f))
+		return 0;
+	return x < 1.0f ? std::min((unsigned)(x * cells), cells - 1) : cells - 1;
+}
+
+// Sort key grouping rays by direction octant, then by direction, then by the Morton order of their origins
+// within the bounds of the level, so that rays next to each other once sorted make coherent packets
+static unsigned waveKey(const Ray &ray, const BoundingBox &origins) {
+	unsigned key = (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) | (ray.dir.z < 0 ? 4 : 0);
+	for (int k = 0; k < 3; k++)
+		key = key << 3 | quantize((ray.dir[k] + 1.0f) * 0.5f, 8);
+	unsigned morton = 0;
+	for (int k = 0; k < 3; k++) {
+		float extent = origins.max[k] - origins.min[k];
+		unsigned cell = extent > 0 ? quantize((ray.from[k] - origins.min[k]) / extent, 64) : 0;
+		for (int b = 0; b < 6; b++)
+			morton |= (cell >> b & 1) << (3 * b + k);
+	}
+	return key << 18 | morton;
+}
+
+// Stable radix sort of (key << 32 | index) pairs by their 30-bit waveKey, ten bits a pass
+static void sortWaveKeys(std::vector<unsigned long long> &order, std::vector<unsigned long long> &temp) {
+	temp.resize(order.size());
+	for (int shift = 32; shift < 62; shift += 10) {
+		int counts[1024] = {};
+		for (unsigned long long v : order)
+			counts[v >> shift & 1023]++;
+		for (int i = 0, sum = 0; i < 1024; i++) {
+			int n = counts[i];
+			counts[i] = sum;
+			sum += n;
+		}
+		for (unsigned long long v : order)
+			temp[counts[v >> shift & 1023]++] = v;
+		order.swap(temp);
+	}
+}
+
+// Traces and shades count rays of a level in sorted order, packetSize rays at a time. Returns the number of
+// rays their hits spawn in the next level.
+static int traceWaveChunk(const FrameContext &frame, TraceContext &ctx, std::vector<WaveRay> &level, const unsigned long long *order, int count, int depth, int packetSize) {
+	const Scene &scene = frame.scene;
+	const RenderParams &params = frame.params;
+	int lights = scene.lights.size();
+	int spawned = 0;
+	for (int first = 0; first < count; first += packetSize) {
+		int n = std::min(packetSize, count - first);
+		WaveRay *w[PACKET_MAX];
+		Ray rays[PACKET_MAX];
+		ObjectId exclude[PACKET_MAX];
+		for (int r = 0; r < n; r++) {
+			w[r] = &level[(unsigned)order[first + r]];
+			rays[r] = w[r]->ray;
+			exclude[r] = w[r]->exclude;
+		}
+		PacketHits hits;
+		findHits(scene, params, ctx, rays, exclude, n, hits);
+		if (packetSize > 1)
+			traceLights(scene, params, ctx, n, hits);
+		for (int r = 0; r < n; r++) {
+			WaveRay &wr = *w[r];
+			if (!(hits.found >> r & 1)) {
+				wr.color = scene.bgColor;
+				continue;
+			}
+			wr.objectID = hits.objectID[r];
+			wr.pos = hits.pos[r];
+			wr.norm = hits.norm[r];
+			wr.m = hits.m[r];
+			wr.isInside = hits.isInside[r];
+			Vec3 reflectionDir = glm::normalize(glm::reflect(wr.ray.dir, wr.norm));
+			wr.color = shadeLocal(scene, params, ctx, wr.objectID, wr.pos, wr.norm, reflectionDir, wr.m, packetSize > 1 && lights > 0 ? &ctx.lit[r * lights] : nullptr);
+			// Spawned rays are marked here and given their place in the next level by emitWaveChunk
+			if (depth < params.depthLimit) {
+				Ray refracted;
+				if (traceBounce(params, ctx, reflectionWeight(wr.weight, wr.m)))
+					wr.reflection = spawned++;
+				if (wr.m->refract && refractRay(wr.ray, wr.pos, wr.norm, wr.isInside, wr.rIndex, wr.m, refracted) && traceBounce(params, ctx, refractionWeight(wr.weight, wr.m)))
+					wr.refraction = spawned++;
+			}
+		}
+	}
+	return spawned;
+}
+
+// Writes the rays spawned by count traced rays of a level, in sorted order, to next from index first on,
+// as shadeHit would trace them
+static void emitWaveChunk(std::vector<WaveRay> &level, const unsigned long long *order, int count, std::vector<WaveRay> &next, int first) {
+	for (int i = 0; i < count; i++) {
+		WaveRay &w = level[(unsigned)order[i]];
+		if (w.reflection >= 0) {
+			w.reflection = first;
+			next[first++] = waveRay({ w.pos, glm::normalize(glm::reflect(w.ray.dir, w.norm)) }, w.objectID, w.rIndex, reflectionWeight(w.weight, w.m));
+		}
+		if (w.refraction >= 0) {
+			Ray refracted;
+			refractRay(w.ray, w.pos, w.norm, w.isInside, w.rIndex, w.m, refracted);
+			w.refraction = first;
+			// For refraction we don't exclude current object
+			next[first++] = waveRay(refracted, {}, w.m->refraction, refractionWeight(w.weight, w.m));
+		}
+	}
+}
+
+// Breadth-first alternative to the tiles of _render. The frame is rendered in waves of primary rays; each
+// level of a wave is sorted by ray direction and origin, traced and shaded in bulk, and spawns the rays of
+// the next level. The ray trees are then resolved from the deepest level up with the arithmetic of shadeHit,
+// so the image is the same as the one rendered depth-first.
+static void renderWavefront(const FrameContext &frame, std::vector<TraceContext> &contexts, ThreadPool &pool, RenderStats &stats) {
+	const RenderParams &params = frame.params;
+	int threads = std::max(params.threads, 1);
+	int samples = std::max(params.samples, 1);
+	int packetSize = params.accel != ACCEL_NONE ? std::max(std::min(params.packetSize, PACKET_MAX), 1) : 1;
+	int pixels = params.width * params.height;
+	int wavePixels = std::max(WAVEFRONT_RAYS / samples, 1);
+	// Levels keep their storage from wave to wave; sizes holds the rays of each in the current wave
+	std::vector<std::vector<WaveRay>> levels(params.depthLimit + 1);
+	std::vector<int> sizes(params.depthLimit + 1);
+	std::vector<unsigned long long> order, temp;
+	std::vector<int> spawned;
+	int runs = 0;
+	auto account = [&](int tasks) {
+		stats.tiles += tasks;
+		for (const WorkerStats &w : pool.workerStats())
+			stats.stolenTiles += w.stolenTasks;
+		stats.loadBalance += pool.loadBalance();
+		runs++;
+	};
+
+	for (int p0 = 0; p0 < pixels; p0 += wavePixels) {
+		int p1 = std::min(p0 + wavePixels, pixels);
+		// Primary rays, the samples of a pixel next to each other as in _render
+		std::vector<WaveRay> &primary = levels[0];
+		sizes[0] = (p1 - p0) * samples;
+		if ((int)primary.size() < sizes[0])
+			primary.resize(sizes[0]);
+		pool.parallelFor(sizes[0], threads, BUILD_GRAIN, [&](int begin, int end) {
+			float px[TILE_SIZE], py[TILE_SIZE], dir[3][TILE_SIZE];
+			for (int i0 = begin; i0 < end; i0 += TILE_SIZE) {
+				int n = std::min(TILE_SIZE, end - i0);
+				for (int i = 0; i < TILE_SIZE; i++) {
+					int pixel = p0 + (i0 + std::min(i, n - 1)) / samples, s = (i0 + i) % samples;
+					int x = pixel % params.width, y = pixel / params.width;
+					px[i] = (float)x;
+					py[i] = (float)y;
+					if (samples > 1) {
+						px[i] += jitter(x, y, s, 0);
+						py[i] += jitter(x, y, s, 1);
+					}
+				}
+				cameraRayRow(frame.camera, px, py, dir);
+				for (int i = 0; i < n; i++)
+					primary[i0 + i] = waveRay(Ray(frame.camera.origin, Vec3(dir[0][i], dir[1][i], dir[2][i])), {}, 1.0f, 1.0f);
+			}
+		});
+
+		int depth = 0;
+		for (; depth <= params.depthLimit && sizes[depth] > 0; depth++) {
+			std::vector<WaveRay> &level = levels[depth];
+			int n = sizes[depth];
+			BoundingBox origins = emptyBox();
+			for (int i = 0; i < n; i++)
+				origins = merge(origins, level[i].ray.from);
+			order.resize(n);
+			pool.parallelFor(n, threads, BUILD_GRAIN, [&](int begin, int end) {
+				for (int i = begin; i < end; i++)
+					order[i] = (unsigned long long)waveKey(level[i].ray, origins) << 32 | (unsigned)i;
+			});
+			sortWaveKeys(order, temp);
+
+			// Each chunk counts the rays it spawns, so they can be written in parallel after a prefix sum
+			int chunks = (n + WAVEFRONT_CHUNK - 1) / WAVEFRONT_CHUNK;
+			spawned.assign(chunks + 1, 0);
+			pool.run(chunks, threads, [&](int chunk, int worker) {
+				int begin = chunk * WAVEFRONT_CHUNK;
+				spawned[chunk + 1] = traceWaveChunk(frame, contexts[worker], level, &order[begin], std::min(WAVEFRONT_CHUNK, n - begin), depth, packetSize);
+			});
+			account(chunks);
+			for (int c = 0; c < chunks; c++)
+				spawned[c + 1] += spawned[c];
+			if (depth < params.depthLimit) {
+				std::vector<WaveRay> &next = levels[depth + 1];
+				sizes[depth + 1] = spawned[chunks];
+				if ((int)next.size() < sizes[depth + 1])
+					next.resize(sizes[depth + 1]);
+				pool.run(chunks, threads, [&](int chunk, int worker) {
+					int begin = chunk * WAVEFRONT_CHUNK;
+					emitWaveChunk(level, &order[begin], std::min(WAVEFRONT_CHUNK, n - begin), next, spawned[chunk]);
+				});
+			}
+		}
+
+		// Misses keep the background color unclamped, like _renderPixel
+		for (int d = depth - 1; d >= 0; d--) {
+			std::vector<WaveRay> &level = levels[d];
+			const WaveRay *next = d + 1 < depth ? levels[d + 1].data() : nullptr;
+			pool.parallelFor(sizes[d], threads, BUILD_GRAIN, [&](int begin, int end) {
+				for (int i = begin; i < end; i++) {
+					WaveRay &w = level[i];
+					if (!w.m)
+						continue;
+					Color c = w.color;
+					if (d < params.depthLimit)
+						c = addBounces(c, w.m, w.reflection >= 0 ? next[w.reflection].color : Color(0, 0, 0), w.refraction >= 0 ? &next[w.refraction].color : nullptr);
+					w.color = glm::clamp(c, 0.0f, 1.0f);
+				}
+			});
+		}
+		pool.parallelFor(p1 - p0, threads, BUILD_GRAIN, [&](int begin, int end) {
+			for (int i = begin; i < end; i++) {
+				Color sum = primary[i * samples].color;
+				for (int s = 1; s < samples; s++)
+					sum = sum + primary[i * samples + s].color;
+				frame.pixels[p0 + i] = packColor(sum / (float)samples);
+			}
+		});
+		for (int d = 1; d < depth; d++)
+			sizes[d] = 0;
+	}
+	stats.loadBalance = runs > 0 ? stats.loadBalance / runs : 1.0f;
+}
+
+void render(const Scene &scene, unsigned int *pixels, const RenderParams &params, RenderStats *stats) {
+	const FrameContext frame = {
+		scene,
+		params,
+		pixels,
+		makeCameraRays(scene.camera, params.width, params.height)
+	};
+	int tilesX = (params.width + TILE_SIZE - 1) / TILE_SIZE;
+	int tilesY = (params.height + TILE_SIZE - 1) / TILE_SIZE;
+	int threads = std::max(params.threads, 1);
+	ThreadPool &pool = getThreadPool(threads);
+	// The contexts are kept from frame to frame with their mailboxes; frames are rendered one at a time
+	static std::mutex contextMutex;
+	static std::vector<TraceContext> contexts;
+	std::lock_guard<std::mutex> lock(contextMutex);
+	contexts.resize(threads);
+	for (TraceContext &ctx : contexts) {
+		if (params.accel == ACCEL_OCTREE) {
+			size_t objects = scene.triangles.size() + scene.spheres.size() + scene.instances.size();
+			if (ctx.stamps.size() < objects)
+				ctx.stamps.resize(objects, 0);
+			if (params.packetSize > 1 && ctx.testedRays.size() < objects)
+				ctx.testedRays.resize(objects, 0);
+		}
+		ctx.objectTests = ctx.skippedObjectTests = 0;
+		ctx.secondaryRays = ctx.prunedRays = 0;
+		ctx.shadowRays = ctx.sharedShadowRays = 0;
+		ctx.occluders.assign(scene.lights.size() + 1, Occluder());
+		ctx.occluderTests = ctx.occluderHits = 0;
+	}
+	RenderStats frameStats = {};
+	if (params.wavefront) {
+		renderWavefront(frame, contexts, pool, frameStats);
+	}
+	else {
+		pool.run(tilesX * tilesY, threads, [&frame, tilesX](int tile, int worker) {
+			int x0 = (tile % tilesX) * TILE_SIZE, y0 = (tile / tilesX) * TILE_SIZE;
+			_render(frame, contexts[worker], x0, y0, std::min(x0 + TILE_SIZE, frame.params.width), std::min(y0 + TILE_SIZE, frame.params.height));
+		});
+		frameStats.tiles = tilesX * tilesY;
+		for (const WorkerStats &w : pool.workerStats())
+			frameStats.stolenTiles += w.stolenTasks;
+		frameStats.loadBalance = pool.loadBalance();
+	}
+	if (stats) {
+		*stats = frameStats;
+		for (const TraceContext &ctx : contexts) {
+			stats->objectTests += ctx.objectTests;
+			stats->skippedObjectTests += ctx.skippedObjectTests;
+			stats->secondaryRays += ctx.secondaryRays;
+			stats->prunedRays += ctx.prunedRays;
+			stats->shadowRays += ctx.shadowRays;
+			stats->sharedShadowRays += ctx.sharedShadowRays;
+			stats->occluderTests += ctx.occluderTests;
+			stats->occluderHits += ctx.occluderHits;
+		}
 	}
 }
@@ -2,6 +2,8 @@
 #define _CRT_SECURE_NO_WARNINGS
 #endif
 #include <vector>
+#include <functional>
+#include "glm/vec2.hpp"
 #include "glm/vec3.hpp"
 #include "glm/mat4x4.hpp"
 
@@ -14,12 +16,14 @@ typedef std::function<Color(glm::vec2)> TextureFunc;
 enum ObjectType {
 	INVALID,
 	SPHERE,
-	TRIANGLE
+	TRIANGLE,
+	INSTANCE
 };
 
 struct ObjectId {
 	ObjectType type;
 	int index;
+	int prim; // triangle within the instance's mesh
 };
 
 struct Material {
@@ -73,30 +77,145 @@ struct BoundingBox {
 	Vec3 min, max;
 };
 
+// Structure-of-arrays copy of triangle geometry for the SIMD intersection kernel: per coordinate,
+// the first vertex v0 and the edges e1 = v1 - v0 and e2 = v2 - v0 of every triangle
+struct TriangleBatch {
+	std::vector<float> v0[3], e1[3], e2[3];
+	std::vector<int> index; // triangle each slot was copied from
+	std::vector<unsigned char> transparent; // refracting material, so no shadow is cast
+};
+
 struct OctreeNode {
 	BoundingBox bounds;
-	std::vector<int> objects;
-	OctreeNode *subnodes[8];
-	bool leaf;
+	int subnodes[8]; // inner node: index of the child in each octant, or -1 where it would be empty
+	int offset; // leaf: first index into Octree::objects
+	int count; // number of objects in a leaf, 0 for inner nodes
+	int triangles; // leaf: how many of its objects are triangles; they come first
+	int spheres; // leaf: how many spheres follow the triangles; the instances come last
+};
+
+// Kept in flat arrays that are cleared, not freed, between builds
+struct Octree {
+	std::vector<OctreeNode> nodes; // depth-first from the root, so every subtree is contiguous
+	std::vector<ObjectId> objects; // triangles, spheres and instances of all leaves, each leaf a contiguous range
+	TriangleBatch batch; // in object order; sphere and instance slots are empty
+};
+
+struct BVHNode {
+	BoundingBox bounds;
+	int offset; // leaf: first index into BVH::objects, inner node: index of the right child
+	int count; // number of objects in a leaf, 0 for inner nodes
+};
+
+// Children of a wide BVH node, one per SIMD lane, so a ray is tested against all of their boxes at once
+#if defined(__AVX__)
+const int BVH_WIDTH = 8;
+#else
+const int BVH_WIDTH = 4;
+#endif
+
+// A binary BVH collapsed for traversal; child bounds are stored as structure of arrays
+struct WideBVHNode {
+	float min[3][BVH_WIDTH], max[3][BVH_WIDTH];
+	int offset[BVH_WIDTH]; // leaf child: first index into BVH::objects, inner child: index of its wide node
+	int count[BVH_WIDTH]; // number of objects in a leaf child, 0 for an inner child
+	int children; // slots in use, the first ones; the others are zero
+};
+
+struct BVH {
+	std::vector<BVHNode> nodes; // depth-first, the left child follows its parent
+	std::vector<WideBVHNode> wide; // collapsed from nodes, the root first
+	std::vector<ObjectId> objects;
+};
+
+// Static indexed geometry with its own bottom-level BVH, built once with buildMesh().
+// Triangle i is made of vertices[indices[3 * i + k]] for k = 0..2; face normals are derived from them.
+struct Mesh {
+	std::vector<Vec3> vertices;
+	std::vector<glm::vec2> texCoords; // one per vertex, or empty
+	std::vector<unsigned int> indices;
+	Material *material; // shared by all triangles, instances may override it
+	BVH bvh;
+	TriangleBatch batch; // in BVH object order, so a leaf is a contiguous range of slots
+
+	Mesh() : material(nullptr) { }
+	int triangleCount() const { return indices.size() / 3; }
+};
+
+// A mesh placed in the scene; rays are moved into the mesh's object space to intersect it
+struct Instance {
+	const Mesh *mesh;
+	Mat4 transform;
+	Mat4 invTransform;
+	Material *material; // overrides the mesh's materials unless null
 };
 
 struct Scene {
 	std::vector<Sphere> spheres;
 	std::vector<Triangle> triangles;
+	std::vector<Instance> instances;
 	std::vector<Light> lights;
 	Camera camera;
 	Color bgColor;
-	OctreeNode octreeRoot;
+	Octree octree;
+	BVH bvh; // top level over spheres, triangles and instances
+	TriangleBatch batch; // scene triangles in top-level BVH object order; other slots are empty
+
+	Scene() { }
+	// A scene is shared read-only by all render threads and is never copied
+	Scene(const Scene &) = delete;
+	Scene &operator=(const Scene &) = delete;
+};
+
+enum AccelType {
+	ACCEL_NONE,
+	ACCEL_OCTREE,
+	ACCEL_BVH
 };
 
 struct RenderParams {
-	bool enableOctree;
+	AccelType accel;
 	int depthLimit;
 	int width;
 	int height;
 	int threads;
+	int samples; // primary rays per pixel; more than one are jittered within the pixel and averaged
+	int packetSize; // primary and shadow rays traced together: 4, 8 or 16, or 0 to trace rays alone
+	float minRayWeight; // reflection and refraction rays carrying at most this share of the pixel are not traced
+	bool wavefront; // trace every bounce of many pixels at once, sorted into coherent packets, instead of tile by tile
+};
+
+struct RenderStats {
+	int tiles; // or chunks of wavefront levels
+	int stolenTiles;
+	float loadBalance; // mean over max busy time of the render threads, 1 = perfectly balanced
+	long long objectTests; // octree triangle, sphere and instance tests
+	long long skippedObjectTests; // repeated octree object tests avoided by mailboxing
+	long long secondaryRays; // reflection and refraction rays traced
+	long long prunedRays; // reflection and refraction rays skipped for their weight
+	long long shadowRays; // occlusion rays traced toward lights and along specular reflections
+	long long sharedShadowRays; // occlusion queries answered by an identical one from the same hit
+	long long occluderTests; // shadow rays tested first against the last occluder of their light
+	long long occluderHits; // shadow rays found blocked by it, without a traversal
+};
+
+struct BuildStats {
+	double buildTime; // seconds
+	int nodes;
+	int references; // object references stored in leaves
 };
 
-void buildOctree(Scene &scene);
+// Builders split their work across the first threads workers of the shared thread pool
+void buildOctree(Scene &scene, int threads = 1, BuildStats *stats = nullptr);
 void destroyOctree(Scene &scene);
-void render(const Scene &scene, unsigned int *pixels, const RenderParams &params);
\ No newline at end of file
+void buildMesh(Mesh &mesh, int threads = 1, BuildStats *stats = nullptr);
+// Refills mesh.batch and the wide nodes from mesh.bvh, for a BVH that was loaded instead of built
+void fillMeshBatch(Mesh &mesh);
+// Whether the indices and BVH of a loaded mesh are in range and laid out as buildMesh() lays them out
+bool checkMesh(const Mesh &mesh);
+Instance makeInstance(const Mesh &mesh, const Mat4 &transform, Material *material = nullptr);
+void buildBVH(Scene &scene, int threads = 1, BuildStats *stats = nullptr);
+void destroyBVH(Scene &scene);
+void buildAccel(Scene &scene, const RenderParams &params, BuildStats *stats = nullptr);
+// The scene must not be modified until render() returns
+void render(const Scene &scene, unsigned int *pixels, const RenderParams &params, RenderStats *stats = nullptr);
\ No newline at end of file
@@ -0,0 +1,145 @@
+#include <memory>
+#include <chrono>
+#include <algorithm>
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(int threads) : current(nullptr), generation(0), used(0), active(0), quit(false) {
+	grow(std::max(threads, 1));
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		quit = true;
+	}
+	wake.notify_all();
+	for (std::thread &t : workers)
+		t.join();
+}
+
+// Between runs every worker is waiting for the next generation, so the arrays can grow
+void ThreadPool::grow(int threads) {
+	std::lock_guard<std::mutex> runLock(runMutex);
+	int seen;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		seen = generation;
+	}
+	for (int i = size(); i < threads; i++) {
+		queues.emplace_back();
+		stats.push_back(WorkerStats());
+		workers.emplace_back(&ThreadPool::workerLoop, this, i, seen);
+	}
+}
+
+void ThreadPool::run(int count, int threads, const std::function<void(int, int)> &task) {
+	std::lock_guard<std::mutex> runLock(runMutex);
+	int n = std::max(std::min(threads, size()), 1);
+	for (int i = 0; i < size(); i++) {
+		std::lock_guard<std::mutex> lock(queues[i].mutex);
+		queues[i].tasks.clear();
+		for (int t = (int)((long long)count * i / n); i < n && t < (int)((long long)count * (i + 1) / n); t++)
+			queues[i].tasks.push_back(t);
+		stats[i] = WorkerStats();
+	}
+
+	std::unique_lock<std::mutex> lock(mutex);
+	current = &task;
+	used = n;
+	active = n;
+	generation++;
+	wake.notify_all();
+	done.wait(lock, [this] { return active == 0; });
+	current = nullptr;
+}
+
+void ThreadPool::parallelFor(int count, int threads, int grain, const std::function<void(int, int)> &body) {
+	int chunks = (count + grain - 1) / std::max(grain, 1);
+	if (chunks <= 1 || threads <= 1) {
+		body(0, count);
+		return;
+	}
+	run(chunks, threads, [&](int chunk, int worker) {
+		body((int)((long long)count * chunk / chunks), (int)((long long)count * (chunk + 1) / chunks));
+	});
+}
+
+bool ThreadPool::nextTask(int id, int &task, bool &stolen) {
+	{
+		TaskQueue &own = queues[id];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.tasks.empty()) {
+			task = own.tasks.front();
+			own.tasks.pop_front();
+			stolen = false;
+			return true;
+		}
+	}
+	// Steal from the end of another queue, which is the work its owner would reach last
+	int n = used;
+	for (int i = 1; i < n; i++) {
+		TaskQueue &victim = queues[(id + i) % n];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.tasks.empty()) {
+			task = victim.tasks.back();
+			victim.tasks.pop_back();
+			stolen = true;
+			return true;
+		}
+	}
+	return false;
+}
+
+// seen is the generation when the worker was added, so it doesn't join a run() that started before
+void ThreadPool::workerLoop(int id, int seen) {
+	for (;;) {
+		const std::function<void(int, int)> *task;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			wake.wait(lock, [&] { return quit || generation != seen; });
+			if (quit)
+				return;
+			seen = generation;
+			if (id >= used)
+				continue;
+			task = current;
+		}
+
+		// Tasks never add new work, so once every queue is empty the run is finished
+		auto start = std::chrono::steady_clock::now();
+		WorkerStats &s = stats[id];
+		int t;
+		bool stolen;
+		while (nextTask(id, t, stolen)) {
+			(*task)(t, id);
+			s.tasks++;
+			if (stolen)
+				s.stolenTasks++;
+		}
+		s.busyTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+		std::lock_guard<std::mutex> lock(mutex);
+		if (--active == 0)
+			done.notify_one();
+	}
+}
+
+float ThreadPool::loadBalance() const {
+	double sum = 0, max = 0;
+	for (int i = 0; i < used; i++) {
+		sum += stats[i].busyTime;
+		max = std::max(max, stats[i].busyTime);
+	}
+	return max > 0 ? (float)(sum / used / max) : 1.0f;
+}
+
+ThreadPool &getThreadPool(int threads) {
+	static std::mutex mutex;
+	static std::unique_ptr<ThreadPool> pool;
+	std::lock_guard<std::mutex> lock(mutex);
+	if (!pool)
+		pool.reset(new ThreadPool(threads));
+	else if (pool->size() < threads)
+		pool->grow(threads);
+	return *pool;
+}
@@ -0,0 +1,64 @@
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
+
+struct WorkerStats {
+	int tasks;
+	int stolenTasks;
+	double busyTime; // seconds
+};
+
+// Long-lived worker threads. Each run() splits the task indices into one contiguous
+// queue per worker taking part; a worker whose queue runs dry steals from the back of the others.
+class ThreadPool {
+public:
+	explicit ThreadPool(int threads);
+	~ThreadPool();
+
+	// Only stable while no other thread can grow the pool
+	int size() const { return (int)workers.size(); }
+
+	// Adds workers up to the given count; waits for a run() in progress to finish
+	void grow(int threads);
+
+	// Calls task(index, worker) for every index in [0, count) on the first threads workers, so
+	// worker < threads, and waits until all are done
+	void run(int count, int threads, const std::function<void(int, int)> &task);
+
+	// Calls body(begin, end) over chunks of about grain indices covering [0, count)
+	void parallelFor(int count, int threads, int grain, const std::function<void(int, int)> &body);
+
+	// Per-worker statistics of the last run(); workers that took no part have zeros
+	const std::vector<WorkerStats> &workerStats() const { return stats; }
+
+	// Mean over max busy time of the workers in the last run(); 1 means perfectly balanced
+	float loadBalance() const;
+
+private:
+	struct TaskQueue {
+		std::mutex mutex;
+		std::deque<int> tasks;
+	};
+
+	void workerLoop(int id, int seen);
+	bool nextTask(int id, int &task, bool &stolen);
+
+	std::vector<std::thread> workers;
+	std::deque<TaskQueue> queues; // grows in place, as a queue holds a mutex
+	std::vector<WorkerStats> stats;
+	const std::function<void(int, int)> *current;
+	std::mutex runMutex;
+	std::mutex mutex;
+	std::condition_variable wake, done;
+	int generation;
+	int used; // workers taking part in the current run()
+	int active;
+	bool quit;
+};
+
+// Process-wide pool shared by rendering and building. It is created once and grows to the largest thread
+// count asked for, never shrinking under another caller; callers pass their own count to run() and parallelFor().
+ThreadPool &getThreadPool(int threads);